@@ -131,6 +131,20 @@
  */
 #define TRY_DENSE_HEAP_START (void *)0x800000000
 
+/*
+ * Set to 1 to align the dense heap to huge pages, ask the kernel to back it
+ * with transparent huge pages, and make it accessible in whole huge pages as
+ * it grows, so that the heap costs as few TLB entries as possible
+ */
+#ifndef HUGE_PAGES
+#define HUGE_PAGES 0
+#endif
+
+/*
+ * Size and alignment of a huge page in bytes
+ */
+#define HUGE_PAGE_SIZE (1UL << 21) /* 2 MB */
+
 /*********** Parameters controlling sparse memory version of heap ***********/
 
 /*
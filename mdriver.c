@@ -107,6 +107,7 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
+    size_t extensions; /* heap extensions while measuring util */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -287,6 +288,7 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
                 fflush(stderr);
             }
             mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].extensions = mem_heap_extensions();
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1) {
@@ -300,11 +302,15 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
 #endif
         if (verbose > 0) {
             putc('.', stderr);
-            if (verbose > 2)
+            if (verbose > 2) {
                 fprintf(stderr, " %d operations.  %ld comparisons.  Avg = %.1f",
                         trace->num_ops, ranges->lo_tree->comparison_count,
                         (double)ranges->lo_tree->comparison_count /
                             trace->num_ops);
+                if (mm_stats[i].valid)
+                    fprintf(stderr, ".  %zu heap extensions",
+                            mm_stats[i].extensions);
+            }
             if (verbose > 1)
                 putc('\n', stderr);
             fflush(stderr);
@@ -753,9 +759,11 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or within a
+       region mapped by mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_is_mapped(lo, size)) {
         malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)",
                      (void *)lo, (void *)hi, (void *)mem_heap_lo(),
                      (void *)mem_heap_hi());
@@ -1090,10 +1098,11 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   peak size of the heap and the regions mapped with mem_map() in
+ *   bytes while running the student's malloc package on the trace. Our
+ *   implementation of mem_sbrk() lets the students decrement the brk
+ *   pointer, so the peak is tracked by memlib rather than read off the
+ *   final brk.
  *
  *   A higher number is better: 1 is optimal.
  */
@@ -1177,7 +1186,7 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
             (total_size > max_total_size) ? total_size : max_total_size;
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_heap_peak());
 }
 
 /*
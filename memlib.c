@@ -70,6 +70,10 @@ static unsigned char *heap;    /* Starting address of heap */
 static unsigned char *mem_brk; /* Current position of break */
 static unsigned char
     *mem_brk_chunk; /* ditto, rounded up to a whole allocation chunk */
+static size_t mem_peak; /* Most bytes in the heap and mapped regions */
+static size_t mem_extensions; /* Calls to mem_sbrk that grew the heap */
+static unsigned char
+    *mem_zero; /* Heap bytes from here up are zero until handed out */
 static unsigned char *mem_max_addr; /* Maximum allowable heap address */
 static size_t mmap_length =
     MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
@@ -78,6 +82,15 @@ static bool show_stats =
 static bool stats_printed =
     false; /* Has information been printed about allocation */
 
+/* Regions handed out by mem_map, kept in a list allocated with libc */
+typedef struct MREG {
+    unsigned char *addr; /* Start of the region */
+    size_t len;          /* Length of the region, a whole number of pages */
+    struct MREG *next;   /* Next region */
+} mem_region_t;
+static mem_region_t *mem_regions = NULL; /* Mapped regions */
+static size_t mem_mapped = 0;            /* Bytes in mapped regions */
+
 /* Sparse memory representation */
 static mem_block_t *next_free_page = NULL; /* Next free page */
 static size_t num_pages = 0;               /* Total number of pages */
@@ -113,7 +126,13 @@ const char *__msan_default_options(void) {
 static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
+static void forget_mem(const void *addr, size_t size);
+static void unmap_all(void);
+static void update_peak(void);
+static unsigned char *fresh_zero(void);
 static void print_stats(void);
+static size_t mem_chunksize(void);
+static void advise_huge(void);
 
 /*
  * Internal helpers
@@ -177,8 +196,10 @@ void mem_init(bool do_sparse) {
        by mapping it PROT_NONE initially and then changing pages to
        PROT_READ|PROT_WRITE upon calls to mem_sbrk.  */
     int prot = sparse ? PROT_READ | PROT_WRITE : PROT_NONE;
+    /* With huge pages, reserve an extra huge page to align the heap to */
+    size_t slack = (HUGE_PAGES && !sparse) ? HUGE_PAGE_SIZE : 0;
     void *addr = mmap(start,                       /* suggested start*/
-                      mmap_length,                 /* length */
+                      mmap_length + slack,         /* length */
                       prot,                        /* access control */
                       MAP_PRIVATE | MAP_ANONYMOUS, /* private anonymous mem */
                       -1,                          /* fd */
@@ -189,6 +210,18 @@ void mem_init(bool do_sparse) {
                 strerror(errno));
         exit(1);
     }
+    if (slack != 0) {
+        /* Give back what lies outside of the aligned heap */
+        unsigned char *lo = addr;
+        unsigned char *aligned = round_address_up(addr, HUGE_PAGE_SIZE);
+        if (aligned > lo) {
+            munmap(lo, (size_t)(aligned - lo));
+        }
+        if (lo + slack > aligned) {
+            munmap(aligned + mmap_length, (size_t)(lo + slack - aligned));
+        }
+        addr = aligned;
+    }
     if (round_address_down(addr, mem_pagesize()) != addr) {
         fprintf(stderr,
                 "FAILURE.  Initial heap address (%p) is not page aligned\n",
@@ -203,10 +236,14 @@ void mem_init(bool do_sparse) {
     } else {
         heap = addr;
         mem_max_addr = heap + mmap_length;
+        advise_huge();
     }
     stats_printed = false;
     mem_brk = heap;
     mem_brk_chunk = heap;
+    mem_peak = 0;
+    mem_extensions = 0;
+    mem_zero = fresh_zero();
 }
 
 /*
@@ -214,6 +251,7 @@ void mem_init(bool do_sparse) {
  */
 void mem_deinit(void) {
     print_stats();
+    unmap_all();
     munmap(heap, mmap_length);
     next_free_page = NULL;
     num_free_pages = 0;
@@ -226,6 +264,7 @@ void mem_deinit(void) {
  */
 void mem_reset_brk(void) {
     print_stats();
+    unmap_all();
     if (sparse) {
         /* Clear page table */
         size_t ptb = num_buckets * sizeof(mem_block_t *);
@@ -244,6 +283,7 @@ void mem_reset_brk(void) {
                     strerror(errno));
             exit(1);
         }
+        advise_huge();
 #ifdef USE_MSAN
         /* Mark global variables as uninitialized */
         markGlobalsUninit();
@@ -251,23 +291,68 @@ void mem_reset_brk(void) {
     }
     mem_brk = heap;
     mem_brk_chunk = heap;
+    mem_peak = 0;
+    mem_extensions = 0;
+    mem_zero = fresh_zero();
+}
+
+/*
+ * mem_shrink - shrink the heap by decr bytes, making the whole pages above
+ *              the new break inaccessible again and discarding them
+ */
+static void *mem_shrink(size_t decr) {
+    unsigned char *old_brk = mem_brk;
+
+    if (decr > (size_t)(mem_brk - heap)) {
+        fprintf(stderr,
+                "ERROR: mem_sbrk failed.  Attempt to shrink heap by %zu "
+                "bytes, below its start\n",
+                decr);
+        errno = EINVAL;
+        return (void *)-1;
+    }
+
+    unsigned char *new_brk = old_brk - decr;
+    unsigned char *new_brk_chunk = round_address_up(new_brk, mem_chunksize());
+    if (sparse) {
+        /* Reads of the released bytes are uninitialized again */
+        forget_mem(new_brk, decr);
+    } else {
+        if (new_brk_chunk < mem_brk_chunk &&
+            (madvise(new_brk_chunk, (size_t)(mem_brk_chunk - new_brk_chunk),
+                     MADV_DONTNEED) == -1 ||
+             mprotect(new_brk_chunk, (size_t)(mem_brk_chunk - new_brk_chunk),
+                      PROT_NONE) == -1)) {
+            fprintf(stderr,
+                    "ERROR: releasing %zd bytes at %p failed (%s)\n",
+                    mem_brk_chunk - new_brk_chunk, (void *)new_brk_chunk,
+                    strerror(errno));
+            return (void *)-1;
+        }
+#ifdef USE_ASAN
+        __asan_poison_memory_region(new_brk, decr);
+#endif
+    }
+
+    mem_brk_chunk = new_brk_chunk;
+    mem_brk = new_brk;
+    if (mem_zero > new_brk_chunk && !sparse) {
+        /* The released pages read as zero when they are handed out again */
+        mem_zero = new_brk_chunk;
+    }
+    return old_brk;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * A negative incr shrinks the heap instead, and returns the old break.
  */
 void *mem_sbrk(intptr_t incr) {
     unsigned char *old_brk = mem_brk;
 
     if (incr < 0) {
-        fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
-        errno = EINVAL;
-        return (void *)-1;
+        return mem_shrink((size_t)-incr);
     }
     if (mem_brk + incr > mem_max_addr) {
         ptrdiff_t alloc = mem_brk - heap + incr;
@@ -280,7 +365,7 @@ void *mem_sbrk(intptr_t incr) {
     }
 
     unsigned char *new_brk = old_brk + incr;
-    unsigned char *new_brk_chunk = round_address_up(new_brk, mem_pagesize());
+    unsigned char *new_brk_chunk = round_address_up(new_brk, mem_chunksize());
     if (!sparse) {
         /* Make the requested section of the heap be accessible.
          * sbrk accepts any 'incr' value, but mprotect only works on
@@ -311,6 +396,13 @@ void *mem_sbrk(intptr_t incr) {
 
     mem_brk_chunk = new_brk_chunk;
     mem_brk = new_brk;
+    if (mem_zero < new_brk) {
+        mem_zero = new_brk;
+    }
+    if (incr > 0) {
+        mem_extensions++;
+    }
+    update_peak();
     return old_brk;
 }
 
@@ -335,6 +427,203 @@ size_t mem_heapsize(void) {
     return (size_t)(mem_brk - heap);
 }
 
+/*
+ * mem_heap_peak - returns the largest number of bytes in the heap and the
+ *                 mapped regions together since the last reset
+ */
+size_t mem_heap_peak(void) {
+    return mem_peak;
+}
+
+/*
+ * mem_heap_extensions - returns the number of calls to mem_sbrk that grew
+ *                       the heap since the last reset
+ */
+size_t mem_heap_extensions(void) {
+    return mem_extensions;
+}
+
+/*
+ * mem_heap_zero - returns the lowest heap address from which every byte is
+ *                 zero, up to the maximum heap address.  Bytes mem_sbrk
+ *                 hands out at or above this address are known to be zero.
+ */
+void *mem_heap_zero(void) {
+    return (void *)mem_zero;
+}
+
+/*
+ * fresh_zero - returns the value of mem_zero for an empty heap.  Reading a
+ *              byte of the emulated heap before writing it is an error in
+ *              sparse mode and under MSan, so no bytes are promised there.
+ */
+static unsigned char *fresh_zero(void) {
+#ifdef USE_MSAN
+    return mem_max_addr;
+#else
+    return sparse ? mem_max_addr : heap;
+#endif
+}
+
+/*
+ * update_peak - account for the current heap and mapped regions in the peak
+ */
+static void update_peak(void) {
+    size_t total = (size_t)(mem_brk - heap) + mem_mapped;
+    if (total > mem_peak) {
+        mem_peak = total;
+    }
+}
+
+/*
+ * mem_map - simple model of an anonymous mmap.  Maps a region of at least
+ *           len bytes, outside of the heap, and returns its start address.
+ */
+void *mem_map(size_t len) {
+    mem_region_t *region = malloc(sizeof(mem_region_t));
+    if (region == NULL) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+
+    len = (len + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "ERROR: mem_map failed.  Mapping %zu bytes (%s)\n",
+                len, strerror(errno));
+        free(region);
+        return (void *)-1;
+    }
+
+    region->addr = addr;
+    region->len = len;
+    region->next = mem_regions;
+    mem_regions = region;
+    mem_mapped += len;
+    update_peak();
+    return addr;
+}
+
+/*
+ * mem_unmap - unmap a region returned by mem_map
+ */
+int mem_unmap(void *addr) {
+    mem_region_t **link = &mem_regions;
+    while (*link != NULL && (*link)->addr != addr)
+        link = &(*link)->next;
+    if (*link == NULL) {
+        fprintf(stderr, "ERROR: mem_unmap failed.  %p is not mapped\n", addr);
+        errno = EINVAL;
+        return -1;
+    }
+
+    mem_region_t *region = *link;
+    if (munmap(region->addr, region->len) == -1) {
+        fprintf(stderr, "ERROR: mem_unmap failed.  Unmapping %p (%s)\n", addr,
+                strerror(errno));
+        return -1;
+    }
+    *link = region->next;
+    mem_mapped -= region->len;
+    free(region);
+    return 0;
+}
+
+/*
+ * mem_discard - give the whole pages of [addr, addr + len) back to the
+ *               system, like madvise(MADV_DONTNEED).  The range stays part
+ *               of the heap, and its bytes read as zero (uninitialized in
+ *               sparse mode) until written again.
+ */
+int mem_discard(void *addr, size_t len) {
+    unsigned char *lo = addr;
+    if (lo < heap || lo + len > mem_brk) {
+        fprintf(stderr,
+                "ERROR: mem_discard failed.  [%p, %p) is not in the heap\n",
+                addr, (void *)(lo + len));
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (sparse) {
+        forget_mem(lo, len);
+        return 0;
+    }
+
+    unsigned char *start = round_address_up(lo, mem_pagesize());
+    unsigned char *end = round_address_down(lo + len, mem_pagesize());
+    if (start < end &&
+        madvise(start, (size_t)(end - start), MADV_DONTNEED) == -1) {
+        fprintf(stderr, "ERROR: discarding %zd bytes at %p failed (%s)\n",
+                end - start, (void *)start, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * mem_discard_zeroes - returns whether discarded pages read as zero, which
+ *                      they do wherever fresh heap bytes do
+ */
+bool mem_discard_zeroes(void) {
+    return fresh_zero() == heap;
+}
+
+/*
+ * mem_is_mapped - returns whether [lo, lo + len) lies in a mapped region
+ */
+bool mem_is_mapped(const void *lo, size_t len) {
+    const unsigned char *p = lo;
+    for (mem_region_t *region = mem_regions; region != NULL;
+         region = region->next) {
+        if (p >= region->addr && p + len <= region->addr + region->len)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * mem_mapped_size - returns the number of bytes in mapped regions
+ */
+size_t mem_mapped_size(void) {
+    return mem_mapped;
+}
+
+/*
+ * unmap_all - unmap every region returned by mem_map
+ */
+static void unmap_all(void) {
+    while (mem_regions != NULL) {
+        mem_region_t *region = mem_regions;
+        munmap(region->addr, region->len);
+        mem_regions = region->next;
+        free(region);
+    }
+    mem_mapped = 0;
+}
+
+/*
+ * mem_chunksize - returns the granularity at which the dense heap is made
+ *                 accessible and released: a huge page with HUGE_PAGES
+ */
+static size_t mem_chunksize(void) {
+    return (HUGE_PAGES && !sparse) ? HUGE_PAGE_SIZE : mem_pagesize();
+}
+
+/*
+ * advise_huge - with HUGE_PAGES, ask for the dense heap to be backed by
+ *               transparent huge pages.  This is only a hint, so failure
+ *               is ignored.
+ */
+static void advise_huge(void) {
+#ifdef MADV_HUGEPAGE
+    if (HUGE_PAGES && !sparse) {
+        madvise(heap, mmap_length, MADV_HUGEPAGE);
+    }
+#endif
+}
+
 /*
  * mem_pagesize - returns the page size of the system
  */
@@ -524,8 +813,9 @@ static void print_stats(void) {
                ppages, num_pages, pbytes, vbytes,
                100.0 * (double)pbytes / (double)vbytes, (void *)mem_brk);
     } else {
-        printf("Allocated %zu heap bytes.  Max address = %p\n", vbytes,
-               (void *)mem_brk);
+        printf("Allocated %zu heap bytes in %zu extensions.  Max address = "
+               "%p\n",
+               vbytes, mem_extensions, (void *)mem_brk);
     }
     stats_printed = true;
 }
@@ -613,3 +903,26 @@ static void *get_mem(const void *addr, size_t size, bool isWrite) {
 
     return (void *)&block->bytes[offset];
 }
+
+/* Mark bytes of the pages that hold them as never written */
+static void forget_mem(const void *addr, size_t size) {
+    const unsigned char *p = addr;
+    const unsigned char *end = p + size;
+    while (p < end) {
+        size_t id = page_id(p);
+        unsigned char *saddr = page_start(id);
+        unsigned char *pend = saddr + SPARSE_PAGE_SIZE;
+        if (pend > end)
+            pend = (unsigned char *)end;
+
+        mem_block_t *block = page_table[id % num_buckets];
+        while (block && block->id != id)
+            block = block->next;
+        if (block) {
+            for (size_t offset = (size_t)(p - saddr);
+                 offset < (size_t)(pend - saddr); offset++)
+                block->initSet[offset / 8] &= (unsigned char)~(1 << (offset % 8));
+        }
+        p = pend;
+    }
+}
@@ -26,13 +26,14 @@ void mem_deinit(void);
 /**
  * @brief Extends the heap by incr bytes.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. A negative incr
+ * shrinks the heap; the whole pages above the new break become inaccessible
+ * and their contents are discarded.
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous
  *         breakpoint)
- * @pre `incr > 0`
+ * @pre `mem_heapsize() + incr >= 0`
  */
 void *mem_sbrk(intptr_t incr);
 
@@ -63,6 +64,86 @@ void *mem_heap_hi(void);
  */
 size_t mem_heapsize(void);
 
+/**
+ * @brief Returns the largest number of bytes taken by the heap and the
+ *        mapped regions together since the heap was last reset.
+ * @return The peak size of the heap and mapped regions, in bytes
+ */
+size_t mem_heap_peak(void);
+
+/**
+ * @brief Returns the number of calls to mem_sbrk that grew the heap since
+ *        it was last reset.
+ * @return The number of heap extensions
+ */
+size_t mem_heap_extensions(void);
+
+/**
+ * @brief Finds the lowest heap address from which every byte is zero.
+ *
+ * Fresh memory is zero-filled, as is memory released by a negative
+ * mem_sbrk, so the bytes mem_sbrk returns at or above this address need not
+ * be cleared. In sparse mode no heap byte is reported as zero, since reading
+ * a byte before writing it is an error.
+ *
+ * @return The lowest address of the zero-filled top of the heap.
+ */
+void *mem_heap_zero(void);
+
+/**
+ * @brief Maps a region of memory outside of the heap.
+ *
+ * This function is a simple model of an anonymous mmap(). The region is
+ * zero-filled, and is unmapped when the heap is reset.
+ *
+ * @param[in] len The minimum size of the region, in bytes
+ * @return The page-aligned start address of the region, or (void *)-1
+ */
+void *mem_map(size_t len);
+
+/**
+ * @brief Unmaps a region returned by mem_map.
+ * @param[in] addr The start address of the region
+ * @return 0 on success, -1 otherwise
+ */
+int mem_unmap(void *addr);
+
+/**
+ * @brief Gives the memory of a range of heap addresses back to the system.
+ *
+ * This function is a simple model of madvise(MADV_DONTNEED). The whole pages
+ * of the range are discarded, and read as zero until written again; the
+ * range stays part of the heap.
+ *
+ * @param[in] addr The first address of the range
+ * @param[in] len  The length of the range, in bytes
+ * @return 0 on success, -1 otherwise
+ */
+int mem_discard(void *addr, size_t len);
+
+/**
+ * @brief Returns whether the pages mem_discard discards read as zero.
+ *
+ * In sparse mode they are uninitialized instead, like fresh heap bytes.
+ *
+ * @return True if discarded pages need not be cleared
+ */
+bool mem_discard_zeroes(void);
+
+/**
+ * @brief Returns whether a range of addresses lies in one mapped region.
+ * @param[in] lo  The first address of the range
+ * @param[in] len The length of the range, in bytes
+ * @return True if the range is mapped by mem_map
+ */
+bool mem_is_mapped(const void *lo, size_t len);
+
+/**
+ * @brief Returns the number of bytes in mapped regions.
+ * @return The total size of the mapped regions, in bytes
+ */
+size_t mem_mapped_size(void);
+
 /**
  * @brief Returns the system page size.
  * @return The page size of the system, in bytes
@@ -20,6 +20,7 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -45,6 +46,14 @@
 
 /* You can change anything from here onward */
 
+#ifdef DRIVER
+#define aligned_alloc mm_aligned_alloc
+#define posix_memalign mm_posix_memalign
+#define memalign mm_memalign
+#define free_sized mm_free_sized
+#define malloc_usable_size mm_malloc_usable_size
+#endif
+
 /*
  *****************************************************************************
  * If DEBUG is defined (such as when running mdriver-dbg), these macros      *
@@ -83,16 +92,56 @@
 
 /* Basic constants */
 
+/*
+ * Build with -DMM_COMPACT=1 for 32-bit headers and footers, and free list
+ * links stored as 32-bit offsets from the start of the memlib heap. Each
+ * block then carries 4 bytes of overhead instead of 8, and payloads stay
+ * 16-byte aligned, as blocks start 4 bytes before a 16-byte boundary. A
+ * header holds sizes below 4 GB, so the heap is capped at that size.
+ */
+#ifndef MM_COMPACT
+#define MM_COMPACT 0
+#endif
+
+#if MM_COMPACT
+typedef uint32_t word_t;
+
+/** @brief A free list link: dsize units from heap_base, 0 for NULL */
+typedef uint32_t link_t;
+#else
 typedef uint64_t word_t;
 
+/** @brief A free list link */
+typedef struct block *link_t;
+#endif
+
 /** @brief Word and header size (bytes) */
 static const size_t wsize = sizeof(word_t);
 
-/** @brief Double word size (bytes) */
-static const size_t dsize = 2 * wsize;
+/** @brief Double word size, the alignment of payloads and sizes (bytes) */
+static const size_t dsize = 16;
+
+/**
+ * @brief Size of a mini block (bytes)
+ *
+ * A mini block has room for a header and a single word, so when free it is
+ * kept on a singly linked list through its `succ` word and has no footer.
+ */
+static const size_t mini_block_size = dsize;
+
+/*
+ * Build with -DMM_TLSF=1 to use the two-level segregated fit (TLSF) engine
+ * instead of the power-of-two segregated lists. Both engines share the
+ * block layout and the free list code below; they differ in how sizes map
+ * to lists and in how find_fit searches them. TLSF has no mini blocks, as
+ * removing one from its singly linked list would take a walk of the list.
+ */
+#ifndef MM_TLSF
+#define MM_TLSF 0
+#endif
 
 /** @brief Minimum block size (bytes) */
-static const size_t min_block_size = 2 * dsize;
+static const size_t min_block_size = MM_TLSF ? 2 * dsize : mini_block_size;
 
 /**
  * @brief Default size for expanding the heap (bytes)
@@ -100,23 +149,306 @@ static const size_t min_block_size = 2 * dsize;
  */
 static const size_t chunksize = (1 << 12);
 
+/*
+ * Build with -DMM_FIT_LIMIT=n to choose the fit policy of the segregated
+ * list engine: find_fit keeps the tightest of the first n fitting blocks of
+ * a list, stopping early on an exact fit. 1 is first fit, 0 is best fit
+ * within the list.
+ */
+#ifndef MM_FIT_LIMIT
+#define MM_FIT_LIMIT 8
+#endif
+
+/** @brief Number of fitting blocks find_fit considers per list (0: all) */
+static const size_t fit_limit = MM_FIT_LIMIT;
+
+/*
+ * Build with -DMM_SLAB_MAX=n to serve requests of up to n bytes from slab
+ * runs (0 disables them). n must not exceed the largest slab slot size.
+ * Slots only save the header over a regular block, while partially used
+ * runs cannot be coalesced, so by default only requests that would
+ * otherwise need a 32-byte block for 16 bytes or less use them.
+ */
+#ifndef MM_SLAB_MAX
+#define MM_SLAB_MAX 16
+#endif
+
+/** @brief Largest request served from a slab run (bytes) */
+static const size_t slab_max = MM_SLAB_MAX;
+
+/*
+ * Build with -DMM_QUICK_MAX=n to keep freed blocks of up to n bytes on
+ * per-size quick lists, still marked allocated and not coalesced, so that
+ * the next request of the same size takes one back at once (0 disables
+ * them). The lists are coalesced into the free lists in bulk when no free
+ * block fits a request, or when one of them holds quick_limit blocks.
+ */
+#ifndef MM_QUICK_MAX
+#define MM_QUICK_MAX 64
+#endif
+
+/** @brief Largest block kept on a quick list (bytes) */
+static const size_t quick_max = MM_QUICK_MAX;
+
+/** @brief Most blocks a quick list holds before the lists are flushed */
+static const uint32_t quick_limit = 8;
+
+/**
+ * @brief Size of a coalesced free block whose freeing flushes the quick
+ *        lists, so that they do not keep the top of the heap from being
+ *        trimmed (bytes)
+ */
+static const size_t quick_flush_size = (1 << 16);
+
+/*
+ * Build with -DMM_PLACE_HIGH=n to carve requests of at least n bytes out of
+ * the high end of a larger free block, and smaller ones out of its low end
+ * (0 places all of them at the low end). Small blocks then gather at the
+ * low end of each free run of memory, and the large ones above them, so
+ * that freeing the large ones leaves larger free blocks behind. The
+ * wilderness is always carved from its low end.
+ */
+#ifndef MM_PLACE_HIGH
+#define MM_PLACE_HIGH 512
+#endif
+
+/** @brief Smallest request placed at the high end of a free block (bytes) */
+static const size_t place_high_min = MM_PLACE_HIGH;
+
+/*
+ * Build with -DMM_TRIM_THRESHOLD=n to choose when free memory goes back to
+ * memlib: once the free block at the top of the heap is larger than n bytes,
+ * it is shrunk to chunksize bytes with a negative mem_sbrk (0 disables it),
+ * or to the next huge page boundary, see MM_HUGE_THRESHOLD.
+ */
+#ifndef MM_TRIM_THRESHOLD
+#define MM_TRIM_THRESHOLD (1 << 17)
+#endif
+
+/** @brief Size of a free block at the top of the heap that is trimmed */
+static const size_t trim_threshold = MM_TRIM_THRESHOLD;
+
+/*
+ * Build with -DMM_PURGE_THRESHOLD=n to give the pages inside free blocks of
+ * at least n bytes back to memlib with mem_discard, wherever they lie in the
+ * heap (0 disables it). Such blocks are flagged as purged, so that when one
+ * grows, only the pages of the blocks it absorbs are purged.
+ */
+#ifndef MM_PURGE_THRESHOLD
+#define MM_PURGE_THRESHOLD (1 << 20)
+#endif
+
+/** @brief Size of a free block whose pages are purged (bytes) */
+static const size_t purge_threshold = MM_PURGE_THRESHOLD;
+
+/*
+ * Build with -DMM_GROWTH=n to choose how much the heap grows when no free
+ * block fits a request:
+ *   0: by the request, and at least chunksize bytes
+ *   1: by what the free block at the top of the heap lacks to fit the
+ *      request, and at least chunksize bytes, which keeps the heap small
+ *   2: like 1, but by at least a step that doubles with every extension up
+ *      to MM_GROWTH_MAX bytes, and falls back to chunksize when the heap is
+ *      trimmed, which saves mem_sbrk calls while the heap grows quickly
+ */
+#ifndef MM_GROWTH
+#define MM_GROWTH 1
+#endif
+
+#ifndef MM_GROWTH_MAX
+#define MM_GROWTH_MAX (1 << 20)
+#endif
+
+/** @brief Heap growth policy, see MM_GROWTH */
+static const int growth_policy = MM_GROWTH;
+
+/** @brief Largest step of the doubling growth policy (bytes) */
+static const size_t growth_max = MM_GROWTH_MAX;
+
+/*
+ * Build with -DMM_HUGE_THRESHOLD=n to lay the heap out for transparent huge
+ * pages (0 disables it; see HUGE_PAGES in config.h for memlib's side). Once
+ * the heap is at least n bytes, it grows and is trimmed so that it ends on a
+ * huge page boundary, and blocks of a huge page or more start on one, so
+ * that they span as few huge pages as possible.
+ */
+#ifndef MM_HUGE_THRESHOLD
+#define MM_HUGE_THRESHOLD 0
+#endif
+
+/** @brief Heap size from which it ends on a huge page boundary (bytes) */
+static const size_t huge_threshold = MM_HUGE_THRESHOLD;
+
+/** @brief Size and alignment of a huge page (bytes) */
+static const size_t huge_page_size = (1 << 21);
+
+/*
+ * Build with -DMM_MAP_THRESHOLD=n to choose the smallest request given its
+ * own region by mem_map, outside of the heap (0 disables them). Freeing such
+ * a block raises the threshold to its size, up to map_threshold_max, so that
+ * programs repeatedly allocating and freeing large blocks reuse heap memory
+ * rather than mapping a new region each time.
+ */
+#ifndef MM_MAP_THRESHOLD
+#define MM_MAP_THRESHOLD (1 << 17)
+#endif
+
+/** @brief Initial size of a request served by mem_map (bytes) */
+static const size_t map_threshold_min = MM_MAP_THRESHOLD;
+
+/** @brief Largest size the mem_map threshold is raised to (bytes) */
+static const size_t map_threshold_max = (1 << 25);
+
+/*
+ * Build with -DMM_THREADS=1 (and -pthread) for a thread-safe allocator: the
+ * heap is protected by a lock, and each thread caches freed small blocks to
+ * serve later requests of the same size without taking it.
+ */
+#ifndef MM_THREADS
+#define MM_THREADS 0
+#endif
+
+#if MM_THREADS
+#include <pthread.h>
+#endif
+
+/*
+ * Build with -DMM_ARENAS=n (together with MM_THREADS) to split the heap into
+ * n arenas, each with its own free lists and lock. Threads are spread over
+ * the arenas round-robin, and move to another arena when theirs is busy.
+ * Arena 0 owns the heap grown with sbrk; the others carve theirs out of it
+ * in aligned arena heaps of arena_heap_size bytes, and fall back to arena 0
+ * for blocks that do not fit in one.
+ */
+#ifndef MM_ARENAS
+#define MM_ARENAS 1
+#endif
+
+#if MM_ARENAS < 1 || MM_ARENAS > 16
+#error "MM_ARENAS must be between 1 and 16"
+#endif
+
+/** @brief Number of arenas in use */
+static const int arena_count = MM_THREADS ? MM_ARENAS : 1;
+
+/**
+ * @brief Size and alignment, relative to the heap start, of the heaps of
+ *        arenas other than arena 0 (bytes)
+ */
+static const size_t arena_heap_size = (1 << 20);
+
+/** @brief Number of arena heaps covered by arena_heap_owner */
+static const size_t arena_heap_count = (1 << 16);
+
+/**
+ * @brief Number of per-thread cache bins, one per word of usable size up to
+ *        64 words (512 bytes, or 256 bytes with MM_COMPACT)
+ */
+static const int tcache_bin_count = 64;
+
+/** @brief Maximum number of blocks in one per-thread cache bin */
+static const uint32_t tcache_bin_max = 16;
+
+/** @brief Number of blocks moved between a cache bin and the heap at once */
+static const uint32_t tcache_batch = 8;
+
+/**
+ * @brief Bytes queued for another arena at which the freeing thread frees
+ *        them itself, if that arena's lock is free
+ */
+static const size_t remote_free_limit = (1 << 16);
+
+/**
+ * @brief Size of a slab run, which is also its alignment (bytes)
+ * (Must be a power of two)
+ */
+static const size_t run_size = (1 << 12);
+
+/** @brief Number of slab size classes */
+static const int slab_class_count = 16;
+
+/** @brief Slot size of each slab size class (bytes) */
+static const size_t slab_sizes[16] = {16,  32,  48,  64,  80,  96,  112, 128,
+                                      160, 192, 224, 256, 320, 384, 448, 512};
+
+/**
+ * @brief Bytes at the start of the heap covered by run_page_map
+ * Slab runs are only ever placed in this part of the heap.
+ */
+static const size_t run_map_span = (1 << 26);
+
+/** @brief Default size of the chunks regions bump allocate from (bytes) */
+static const size_t region_chunk_size = (1 << 14);
+
 /** @brief Mask the allocated bit from a header or footer */
 static const word_t alloc_mask = 0x1;
 
+/**
+ * @brief Mask the "previous block is allocated" bit from a header
+ *
+ * Allocated blocks carry no footer, so a block learns the allocation status
+ * of its predecessor from this bit instead of from the predecessor's footer.
+ */
+static const word_t prev_alloc_mask = 0x2;
+
+/**
+ * @brief Mask the "previous block is a mini block" bit from a header
+ *
+ * Free mini blocks have no footer either, so this bit is how a block finds
+ * its predecessor when that predecessor is a free mini block.
+ */
+static const word_t prev_mini_mask = 0x4;
+
+/**
+ * @brief Mask the "block has its own mapped region" bit from a header
+ *
+ * Such blocks lie outside of the heap, and are unmapped when freed instead
+ * of being returned to an arena.
+ */
+static const word_t mapped_mask = 0x8;
+
+/**
+ * @brief Mask the "pages inside are purged" bit from the header of a free
+ *        block
+ *
+ * Only allocated blocks are ever mapped, so this is the bit of mapped_mask.
+ * Every whole page between the links and the footer of such a block is
+ * purged. Splitting a purged block carries the bit to the free remainder;
+ * other header rewrites clear it, which at worst purges pages again.
+ */
+static const word_t purged_mask = 0x8;
+
 /** @brief Mask the size from a header or footer */
 static const word_t size_mask = ~(word_t)0xF;
 
+/** @brief Largest size a header can hold (bytes) */
+static const size_t max_block_size = size_mask;
+
 /** @brief Represents the doubly linked list structure and payload of one free block in the heap */
 /** @brief Represents the header and payload of one block in the heap */
 typedef struct block {
-    /** @brief Header contains size + allocation flag */
+    /** @brief Header contains size + allocation flag + prev_alloc flag +
+     *         prev_mini flag */
     word_t header;
 
     union {
-        /** @brief if free, keeps record of prev free block and next free block */
+        /**
+         * @brief if free, keeps record of next free block and prev free block.
+         * A free mini block only has room for `succ`.
+         */
         struct {
-            struct block *pred;
-            struct block *succ;
+            link_t succ;
+            link_t pred;
+        };
+
+        /**
+         * @brief if free and in the tree of large blocks, keeps record of
+         * its children and the height of its subtree instead.
+         */
+        struct {
+            link_t left;
+            link_t right;
+            word_t height;
         };
 
         /** @brief if allocated, keeps record to the block payload. */
@@ -124,18 +456,247 @@ typedef struct block {
     };
 } block_t;
 
+/**
+ * @brief Header of a slab run, at the run_size-aligned payload of an
+ *        allocated block of run_size bytes. The slots follow it, and have no
+ *        headers at all; the run a slot belongs to is found by masking the
+ *        slot's address. The last word of the run's page holds the header of
+ *        the next block, so consecutive runs tile the heap.
+ */
+typedef struct run {
+    /** @brief Next and previous run of this class with free slots */
+    struct run *next;
+    struct run *prev;
+    /** @brief Slab size class of the slots */
+    uint32_t size_class;
+    /** @brief Number of free slots */
+    uint32_t nfree;
+    /** @brief Bit i is set if and only if slot i is free */
+    uint64_t free_map[4];
+} run_t;
+
+/**
+ * @brief Per-thread cache of freed blocks.
+ *
+ * Cached blocks stay marked allocated in the heap, so they are never
+ * coalesced; each bin is a LIFO list linked through the first word of the
+ * payloads. Bin i holds blocks with (i + 1) * wsize usable bytes.
+ */
+typedef struct tcache {
+    /** @brief First cached payload of each bin */
+    void *bins[64];
+    /** @brief Number of cached payloads in each bin */
+    uint32_t counts[64];
+    /** @brief Value of heap_generation when the bins were filled */
+    uint64_t generation;
+    /** @brief Whether the thread exit destructor has been registered */
+    bool registered;
+} tcache_t;
+
+/**
+ * @brief A chunk of a region, allocated with malloc.
+ *
+ * Region objects are bump allocated after this header, and have no header
+ * of their own.
+ */
+typedef struct region_chunk {
+    /** @brief Next chunk of the region */
+    struct region_chunk *next;
+    /** @brief Size of the chunk, including this header (bytes) */
+    size_t size;
+} region_chunk_t;
+
+/**
+ * @brief A region, whose objects are all freed at once.
+ *
+ * The first chunk is the one objects are bump allocated from; objects too
+ * large for a chunk get one of their own, linked after it.
+ */
+struct mm_arena {
+    /** @brief Chunks of the region, the current one first */
+    region_chunk_t *chunks;
+    /** @brief Free space left in the current chunk */
+    char *cur;
+    char *end;
+    /** @brief Size of the chunks objects are bump allocated from (bytes) */
+    size_t chunk_size;
+};
+
 /* Global variables */
 
 /** @brief Pointer to first block in the heap */
 static block_t *heap_start = NULL;
 
+/** @brief Set once init_heap has finished, read without a lock */
+static bool heap_ready = false;
+
+/** @brief Start of the memlib heap, which free list links are relative to */
+static char *heap_base = NULL;
+
+#if MM_TLSF
+/**
+ * @brief Arranging free blocks by their size, two-level segregated fit
+ * First level f > 0 holds sizes in [2^(f+6), 2^(f+7)), split linearly into
+ * 8 second-level lists. First level 0 holds sizes below 128 in exact 16-byte
+ * steps; its list 1 would hold mini blocks, which TLSF does not create.
+ */
+static const int fl_count = 58;
+static const int sl_log2 = 3;
+#else
 /**
  * @brief Arranging free blocks by their size
- * 0 ~ 2^4, 2^4+1 ~ 2^5, ... 2^15+1 ~ inf
+ * 0 ~ 2^4, 2^4+1 ~ 2^5, ... 2^17+1 ~ inf
  * In each linked list, it is arranged from small size to big size
+ * List 0 only ever holds mini blocks and is singly linked.
+ */
+static const int fl_count = 15;
+static const int sl_log2 = 0;
+#endif
+
+/** @brief Total number of free lists */
+static const int list_length = fl_count << sl_log2;
+
+/**
+ * @brief The free list holding large blocks in a tree, or -1 for none
+ * The last list of the segregated list engine is an AVL tree ordered by
+ * size and then address, so that its best fit is found in O(log n).
+ */
+static const int tree_list = MM_TLSF ? -1 : fl_count - 1;
+
+/** @brief Sizes below this use first level 0 of the TLSF engine (bytes) */
+static const size_t tlsf_small_size = (size_t)16 << sl_log2;
+
+/**
+ * @brief An arena: free lists and slab runs with their own lock.
+ *
+ * Every block and run belongs to the arena whose heap holds it, and is only
+ * touched with that arena's lock held.
+ */
+typedef struct arena {
+#if MM_THREADS
+    /** @brief Lock protecting everything below and the arena's blocks */
+    pthread_mutex_t lock;
+#endif
+    /** @brief Segregated free lists, see find_index */
+    block_t *segregated_list[MM_TLSF ? 58 * 8 : 15];
+    /**
+     * @brief First-level occupancy bitmap of the free lists
+     * Bit f is set if and only if some list of first level f is non-empty.
+     */
+    uint64_t fl_bitmap;
+    /**
+     * @brief Second-level occupancy bitmaps of the free lists
+     * Bit s of entry f is set if and only if list (f, s) is non-empty.
+     */
+    uint8_t sl_bitmap[64];
+    /**
+     * @brief The wilderness: a free block right before an epilogue of the
+     *        arena, kept off the free lists, or NULL
+     * Requests no free block fits are carved out of its front.
+     */
+    block_t *top;
+    /** @brief Runs of each slab size class that have free slots */
+    run_t *slab_runs[16];
+    /**
+     * @brief Freed blocks kept allocated, by size, and their number
+     * List i holds blocks of (i + 1) * dsize bytes, linked through `succ`.
+     */
+    block_t *quick_lists[MM_QUICK_MAX / 16 + 1];
+    uint32_t quick_counts[MM_QUICK_MAX / 16 + 1];
+    /** @brief Counters reported by mm_get_stats, reset by mm_init */
+    mm_stats_t stats;
+    /** @brief Number of times the lock was taken, and had to be waited for */
+    size_t lock_acquired;
+    size_t lock_contended;
+    /**
+     * @brief Blocks freed by threads of other arenas, waiting to be freed
+     * A lock-free stack linked through the first word of the payloads:
+     * threads push without the lock, and the lock holder takes all of it.
+     */
+    void *remote_frees;
+    /** @brief Usable bytes of the blocks in remote_frees */
+    size_t remote_bytes;
+    /**
+     * @brief Start of the known-zero top of the arena's memory
+     * Every byte at or above it in the payload of a free block of the arena
+     * is zero, except for the block's links and footer.
+     */
+    char *zero_start;
+} arena_t;
+
+/** @brief The arenas; arena 0 owns the heap start */
+static arena_t arenas[MM_ARENAS];
+
+/**
+ * @brief The arena whose lock this thread holds, which the functions below
+ *        allocate from and free to
+ */
+static _Thread_local arena_t *arena = &arenas[0];
+
+/** @brief The arena this thread allocates from, or NULL if not yet chosen */
+static _Thread_local arena_t *home_arena = NULL;
+
+/**
+ * @brief Bytes of the payload last allocated by this thread that are known
+ *        to be zero, [zero_lo, zero_hi), which calloc need not clear
+ */
+static _Thread_local char *zero_lo = NULL;
+static _Thread_local char *zero_hi = NULL;
+
+/** @brief Smallest request served by mem_map, raised as such blocks are freed */
+static size_t map_threshold = MM_MAP_THRESHOLD;
+
+/** @brief Number of threads that have chosen an arena */
+static unsigned int arenas_assigned = 0;
+
+/**
+ * @brief Epilogue of the heap of arena 0
+ * It is the top of the heap unless another arena has grown the heap since.
+ */
+static block_t *heap_end = NULL;
+
+/**
+ * @brief Least extension of the heap of arena 0 under the doubling growth
+ *        policy, protected by the lock of arena 0
+ */
+static size_t growth_step = 0;
+
+/**
+ * @brief Owner of each arena heap sized, aligned part of the heap
+ * Entry i is the index of the arena owning bytes [i * arena_heap_size,
+ * (i + 1) * arena_heap_size) from the start of the heap, 0 if not an arena
+ * heap.
  */
-static const int list_length = 15;
-block_t *segregated_list[15];
+static uint8_t arena_heap_owner[1 << 16];
+
+/**
+ * @brief Bitmap of the pages of the heap that belong to a slab run
+ * Bit i is set if and only if bytes [i * run_size, (i + 1) * run_size) from
+ * the start of the heap are a run.
+ */
+static uint64_t run_page_map[(1 << 26) / (1 << 12) / 64];
+
+/**
+ * @brief Number of times the heap has been initialized
+ * A thread cache filled under an older generation points into a heap that no
+ * longer exists, and is dropped.
+ */
+static uint64_t heap_generation = 0;
+
+/** @brief This thread's cache of freed blocks */
+static _Thread_local tcache_t tcache;
+
+#if MM_THREADS
+/**
+ * @brief Lock serializing calls to mem_sbrk, mem_map and mem_unmap, taken
+ *        with or without an arena lock held
+ */
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Key whose destructor flushes a thread's cache when it exits */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+#endif
 
 /*
  *****************************************************************************
@@ -167,6 +728,16 @@ static size_t max(size_t x, size_t y) {
     return (x > y) ? x : y;
 }
 
+/**
+ * @brief Returns the higher of two addresses.
+ * @param[in] x
+ * @param[in] y
+ * @return `x` if `x > y`, and `y` otherwise.
+ */
+static char *max_address(void *x, void *y) {
+    return (char *)((x > y) ? x : y);
+}
+
 /**
  * @brief Rounds `size` up to next multiple of n
  * @param[in] size
@@ -178,22 +749,32 @@ static size_t round_up(size_t size, size_t n) {
 }
 
 /**
- * @brief Packs the `size` and `alloc` of a block into a word suitable for
- *        use as a packed value.
+ * @brief Packs the `size`, `prev_alloc`, `prev_mini` and `alloc` of a block
+ *        into a word suitable for use as a packed value.
  *
  * Packed values are used for both headers and footers.
  *
- * The allocation status is packed into the lowest bit of the word.
+ * The allocation status is packed into the lowest bit of the word, the
+ * allocation status of the previous block into the second lowest bit, and
+ * whether the previous block is a mini block into the third lowest bit.
  *
  * @param[in] size The size of the block being represented
+ * @param[in] prev_alloc True if the previous block is allocated
+ * @param[in] prev_mini True if the previous block is a mini block
  * @param[in] alloc True if the block is allocated
  * @return The packed value
  */
-static word_t pack(size_t size, bool alloc) {
+static word_t pack(size_t size, bool prev_alloc, bool prev_mini, bool alloc) {
     word_t word = size;
     if (alloc) {
         word |= alloc_mask;
     }
+    if (prev_alloc) {
+        word |= prev_alloc_mask;
+    }
+    if (prev_mini) {
+        word |= prev_mini_mask;
+    }
     return word;
 }
 
@@ -212,11 +793,16 @@ static size_t extract_size(word_t word) {
 
 /**
  * @brief Extracts the size of a block from its header.
+ *
+ * The owner of an allocated block reads its size without the arena lock,
+ * while the lock holder may update the prev bits of the same header, so the
+ * header is loaded atomically.
+ *
  * @param[in] block
  * @return The size of the block
  */
 static size_t get_size(block_t *block) {
-    return extract_size(block->header);
+    return extract_size(__atomic_load_n(&block->header, __ATOMIC_RELAXED));
 }
 
 /**
@@ -251,7 +837,7 @@ static void *header_to_payload(block_t *block) {
 static word_t *header_to_footer(block_t *block) {
     dbg_requires(get_size(block) != 0 &&
                  "Called header_to_footer on the epilogue block");
-    return (word_t *)(block->payload + get_size(block) - dsize);
+    return (word_t *)(block->payload + get_size(block) - 2 * wsize);
 }
 
 /**
@@ -267,18 +853,90 @@ static block_t *footer_to_header(word_t *footer) {
     return (block_t *)((char *)footer + wsize - size);
 }
 
+/**
+ * @brief Decodes a free list link.
+ * @param[in] link
+ * @return The block it links to, or NULL
+ */
+static block_t *link_to_block(link_t link) {
+#if MM_COMPACT
+    if (link == 0) {
+        return NULL;
+    }
+    return (block_t *)(heap_base + (size_t)link * dsize - wsize);
+#else
+    return link;
+#endif
+}
+
+/**
+ * @brief Encodes a free list link.
+ * @param[in] block A block in the heap, or NULL
+ * @return The link to it
+ */
+static link_t block_to_link(block_t *block) {
+#if MM_COMPACT
+    if (block == NULL) {
+        return 0;
+    }
+    return (link_t)(((char *)block + wsize - heap_base) / dsize);
+#else
+    return block;
+#endif
+}
+
+/** @brief Returns the next block in the free list of a free block. */
+static block_t *get_succ(block_t *block) {
+    return link_to_block(block->succ);
+}
+
+/** @brief Sets the next block in the free list of a free block. */
+static void set_succ(block_t *block, block_t *succ) {
+    block->succ = block_to_link(succ);
+}
+
+/** @brief Returns the previous block in the free list of a free block. */
+static block_t *get_pred(block_t *block) {
+    return link_to_block(block->pred);
+}
+
+/** @brief Sets the previous block in the free list of a free block. */
+static void set_pred(block_t *block, block_t *pred) {
+    block->pred = block_to_link(pred);
+}
+
+/** @brief Returns the left child of a block in the tree of large blocks. */
+static block_t *get_left(block_t *block) {
+    return link_to_block(block->left);
+}
+
+/** @brief Sets the left child of a block in the tree of large blocks. */
+static void set_left(block_t *block, block_t *left) {
+    block->left = block_to_link(left);
+}
+
+/** @brief Returns the right child of a block in the tree of large blocks. */
+static block_t *get_right(block_t *block) {
+    return link_to_block(block->right);
+}
+
+/** @brief Sets the right child of a block in the tree of large blocks. */
+static void set_right(block_t *block, block_t *right) {
+    block->right = block_to_link(right);
+}
+
 /**
  * @brief Returns the payload size of a given block.
  *
- * The payload size is equal to the entire block size minus the sizes of the
- * block's header and footer.
+ * The payload size is equal to the entire block size minus the size of the
+ * block's header. Allocated blocks have no footer.
  *
  * @param[in] block
  * @return The size of the block's payload
  */
 static size_t get_payload_size(block_t *block) {
     size_t asize = get_size(block);
-    return asize - dsize;
+    return asize - wsize;
 }
 
 /**
@@ -303,46 +961,116 @@ static bool get_alloc(block_t *block) {
 }
 
 /**
- * @brief Writes an epilogue header at the given address.
- *
- * The epilogue header has size 0, and is marked as allocated.
- *
- * @param[out] block The location to write the epilogue header
+ * @brief Returns the allocation status of the previous block, based on the
+ *        prev_alloc bit of the given header value.
+ * @param[in] word
+ * @return The allocation status of the previous block
  */
-static void write_epilogue(block_t *block) {
-    dbg_requires(block != NULL);
-    dbg_requires((char *)block == (char *)mem_heap_hi() - 7);
-    block->header = pack(0, true);
+static bool extract_prev_alloc(word_t word) {
+    return (bool)(word & prev_alloc_mask);
 }
 
 /**
- * @brief Writes a block starting at the given address.
- *
- * This function writes both a header and footer, where the location of the
- * footer is computed in relation to the header.
- *
- * @pre Block is non-NULL and free. Size is positive.
- *
- * @param[out] block The location to begin writing the block header
- * @param[in] size The size of the new block
- * @param[in] alloc The allocation status of the new block
+ * @brief Returns the allocation status of the previous block, based on the
+ *        header of the given block.
+ * @param[in] block
+ * @return The allocation status of the previous block
  */
-static void write_block(block_t *block, size_t size, bool alloc) {
-    dbg_requires(block != NULL);
-    dbg_requires(size > 0);
-    block->header = pack(size, alloc);
-    word_t *footerp = header_to_footer(block);
-    *footerp = pack(size, alloc);
+static bool get_prev_alloc(block_t *block) {
+    return extract_prev_alloc(block->header);
 }
 
 /**
- * @brief Finds the next consecutive block on the heap.
- *
- * This function accesses the next block in the "implicit list" of the heap
- * by adding the size of the block.
- *
- * @param[in] block A block in the heap
- * @return The next consecutive block on the heap
+ * @brief Returns whether the previous block is a mini block, based on the
+ *        header of the given block.
+ * @param[in] block
+ * @return True if the previous block is a mini block
+ */
+static bool get_prev_mini(block_t *block) {
+    return (bool)(block->header & prev_mini_mask);
+}
+
+/**
+ * @brief Returns whether the pages inside a free block are purged.
+ * @param[in] block A free block
+ * @return True if its pages were given back to memlib
+ */
+static bool get_purged(block_t *block) {
+    return (block->header & purged_mask) != 0;
+}
+
+/**
+ * @brief Flags the pages inside a free block as purged, in its header and
+ *        its footer.
+ * @param[in] block A free block
+ */
+static void set_purged(block_t *block) {
+    block->header |= purged_mask;
+    if (get_size(block) > mini_block_size) {
+        *header_to_footer(block) |= purged_mask;
+    }
+}
+
+/**
+ * @brief Writes an epilogue header at the given address.
+ *
+ * The epilogue header has size 0, and is marked as allocated.
+ *
+ * @param[out] block The location to write the epilogue header
+ * @param[in] prev_alloc The allocation status of the last block in the heap
+ * @param[in] prev_mini True if the last block in the heap is a mini block
+ */
+static void write_epilogue(block_t *block, bool prev_alloc, bool prev_mini) {
+    dbg_requires(block != NULL);
+    dbg_requires((char *)block <= (char *)mem_heap_hi() + 1 - wsize);
+    block->header = pack(0, prev_alloc, prev_mini, true);
+}
+
+/**
+ * @brief Writes a block starting at the given address.
+ *
+ * This function writes a header, and a footer only if the block is free and
+ * not a mini block, where the location of the footer is computed in relation
+ * to the header. The prev_alloc and prev_mini bits of the next block's header
+ * are updated to match.
+ *
+ * @pre Block is non-NULL. Size is positive. The next block's header has
+ *      been written.
+ *
+ * @param[out] block The location to begin writing the block header
+ * @param[in] size The size of the new block
+ * @param[in] prev_alloc The allocation status of the previous block
+ * @param[in] prev_mini True if the previous block is a mini block
+ * @param[in] alloc The allocation status of the new block
+ */
+static void write_block(block_t *block, size_t size, bool prev_alloc,
+                        bool prev_mini, bool alloc) {
+    dbg_requires(block != NULL);
+    dbg_requires(size > 0);
+    block->header = pack(size, prev_alloc, prev_mini, alloc);
+    if (!alloc && size > mini_block_size) {
+        word_t *footerp = header_to_footer(block);
+        *footerp = pack(size, prev_alloc, prev_mini, alloc);
+    }
+
+    // The next block may be allocated, and its owner reading its header
+    // without the lock
+    block_t *block_next = (block_t *)((char *)block + size);
+    word_t next_header =
+        __atomic_load_n(&block_next->header, __ATOMIC_RELAXED);
+    next_header &= ~(prev_alloc_mask | prev_mini_mask);
+    next_header |= pack(0, alloc, size == mini_block_size, false);
+    __atomic_store_n(&block_next->header, next_header, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Finds the next consecutive block on the heap.
+ *
+ * This function accesses the next block in the "implicit list" of the heap
+ * by adding the size of the block.
+ *
+ * @param[in] block A block in the heap
+ * @return The next consecutive block on the heap
  * @pre The block is not the epilogue
  */
 static block_t *find_next(block_t *block) {
@@ -370,15 +1098,22 @@ static word_t *find_prev_footer(block_t *block) {
  * If the function is called on the first block in the heap, NULL will be
  * returned, since the first block in the heap has no previous block!
  *
- * The position of the previous block is found by reading the previous
+ * A previous mini block is found from the prev_mini bit alone. Otherwise
+ * the position of the previous block is found by reading the previous
  * block's footer to determine its size, then calculating the start of the
- * previous block based on its size.
+ * previous block based on its size. Only free blocks have a footer.
  *
  * @param[in] block A block in the heap
  * @return The previous consecutive block in the heap.
+ * @pre The previous block is free.
  */
 static block_t *find_prev(block_t *block) {
     dbg_requires(block != NULL);
+    dbg_requires(!get_prev_alloc(block));
+    if (get_prev_mini(block)) {
+        return (block_t *)((char *)block - mini_block_size);
+    }
+
     word_t *footerp = find_prev_footer(block);
 
     // Return NULL if called on first block in the heap
@@ -397,20 +1132,232 @@ static block_t *find_prev(block_t *block) {
 
 /******** The remaining content below are helper and debug routines ********/
 
+/**
+ * @brief Finds the segregated list a block of the given size belongs to
+ *
+ * For the segregated list engine, list i > 0 holds sizes in
+ * (2^(i+3), 2^(i+4)], so the index is ceil(log2(size)) - 4, computed with a
+ * count-leading-zeros instruction.
+ *
+ * For the TLSF engine, the first level is floor(log2(size)) - 6 and the
+ * second level is the next sl_log2 bits of the size below its leading one.
+ * The returned index is (first level << sl_log2) | second level.
+ *
+ * @param[in] size The size of the block
+ * @return The index of the free list
+ */
 static int find_index(size_t size) {
+    if (MM_TLSF) {
+        if (size < tlsf_small_size) {
+            return (int)(size / dsize);
+        }
+        int msb = 63 - __builtin_clzl(size);
+        int fl = msb - (sl_log2 + 4) + 1;
+        int sl = (int)(size >> (msb - sl_log2)) & ((1 << sl_log2) - 1);
+        return (fl << sl_log2) | sl;
+    }
+
     if (size <= 16) return 0;
-    for (int i = 1; i < list_length; i++) {
-        if ((1 << (i + 3)) < size && size <= (1 << (i + 4))) {
-            return i;
+    int i = 64 - __builtin_clzl(size - 1) - 4;
+    return (i < list_length) ? i : list_length - 1;
+}
+
+/**
+ * @brief Marks free list i as non-empty in the occupancy bitmaps
+ * @param[in] i The index of the free list
+ */
+static void set_list_bit(int i) {
+    int fl = i >> sl_log2;
+    arena->sl_bitmap[fl] |= (uint8_t)(1 << (i & ((1 << sl_log2) - 1)));
+    arena->fl_bitmap |= (uint64_t)1 << fl;
+}
+
+/**
+ * @brief Marks free list i as empty in the occupancy bitmaps
+ * @param[in] i The index of the free list
+ */
+static void clear_list_bit(int i) {
+    int fl = i >> sl_log2;
+    arena->sl_bitmap[fl] &= (uint8_t)~(1 << (i & ((1 << sl_log2) - 1)));
+    if (arena->sl_bitmap[fl] == 0) {
+        arena->fl_bitmap &= ~((uint64_t)1 << fl);
+    }
+}
+
+/**
+ * @brief Returns the height of a subtree of the tree of large blocks.
+ * @param[in] node The root of the subtree, or NULL
+ * @return The number of nodes on its longest path
+ */
+static size_t tree_height(block_t *node) {
+    return (node == NULL) ? 0 : node->height;
+}
+
+/**
+ * @brief Orders the blocks of the tree by size, then by address.
+ * @param[in] a
+ * @param[in] b
+ * @return True if a comes before b
+ */
+static bool tree_before(block_t *a, block_t *b) {
+    size_t size_a = get_size(a);
+    size_t size_b = get_size(b);
+    return size_a < size_b || (size_a == size_b && a < b);
+}
+
+/**
+ * @brief Rotates a subtree so that the given child of its root becomes the
+ *        root.
+ *
+ * @param[in] node The root of the subtree
+ * @param[in] left Whether to lift the left child (a right rotation)
+ * @return The new root of the subtree
+ */
+static block_t *tree_rotate(block_t *node, bool left) {
+    block_t *child;
+    if (left) {
+        child = get_left(node);
+        set_left(node, get_right(child));
+        set_right(child, node);
+    } else {
+        child = get_right(node);
+        set_right(node, get_left(child));
+        set_left(child, node);
+    }
+    node->height =
+        max(tree_height(get_left(node)), tree_height(get_right(node))) + 1;
+    child->height =
+        max(tree_height(get_left(child)), tree_height(get_right(child))) + 1;
+    return child;
+}
+
+/**
+ * @brief Restores the AVL balance of a subtree whose children are balanced
+ *        and differ in height by at most two.
+ *
+ * @param[in] node The root of the subtree
+ * @return The new root of the subtree
+ */
+static block_t *tree_balance(block_t *node) {
+    size_t left = tree_height(get_left(node));
+    size_t right = tree_height(get_right(node));
+
+    if (left > right + 1) {
+        block_t *child = get_left(node);
+        if (tree_height(get_left(child)) < tree_height(get_right(child))) {
+            set_left(node, tree_rotate(child, false));
+        }
+        return tree_rotate(node, true);
+    }
+    if (right > left + 1) {
+        block_t *child = get_right(node);
+        if (tree_height(get_right(child)) < tree_height(get_left(child))) {
+            set_right(node, tree_rotate(child, true));
+        }
+        return tree_rotate(node, false);
+    }
+
+    node->height = max(left, right) + 1;
+    return node;
+}
+
+/**
+ * @brief Inserts a block into a subtree of the tree of large blocks.
+ *
+ * @param[in] node The root of the subtree, or NULL
+ * @param[in] block The block to be inserted
+ * @return The new root of the subtree
+ */
+static block_t *tree_insert(block_t *node, block_t *block) {
+    if (node == NULL) {
+        set_left(block, NULL);
+        set_right(block, NULL);
+        block->height = 1;
+        return block;
+    }
+    if (tree_before(block, node)) {
+        set_left(node, tree_insert(get_left(node), block));
+    } else {
+        set_right(node, tree_insert(get_right(node), block));
+    }
+    return tree_balance(node);
+}
+
+/**
+ * @brief Removes the first block of a subtree of the tree of large blocks.
+ *
+ * @param[in] node The root of the subtree
+ * @param[out] first The removed block
+ * @return The new root of the subtree
+ */
+static block_t *tree_remove_first(block_t *node, block_t **first) {
+    if (get_left(node) == NULL) {
+        *first = node;
+        return get_right(node);
+    }
+    set_left(node, tree_remove_first(get_left(node), first));
+    return tree_balance(node);
+}
+
+/**
+ * @brief Removes a block from a subtree of the tree of large blocks.
+ *
+ * @param[in] node The root of the subtree
+ * @param[in] block The block to be removed, which is in the subtree
+ * @return The new root of the subtree
+ */
+static block_t *tree_remove(block_t *node, block_t *block) {
+    dbg_requires(node != NULL);
+
+    if (node != block) {
+        if (tree_before(block, node)) {
+            set_left(node, tree_remove(get_left(node), block));
+        } else {
+            set_right(node, tree_remove(get_right(node), block));
         }
+        return tree_balance(node);
     }
-    return list_length - 1;
+
+    // The block is replaced by the first block of its right subtree
+    if (get_left(node) == NULL || get_right(node) == NULL) {
+        return (get_left(node) != NULL) ? get_left(node) : get_right(node);
+    }
+    block_t *next;
+    block_t *right = tree_remove_first(get_right(node), &next);
+    set_left(next, get_left(node));
+    set_right(next, right);
+    return tree_balance(next);
 }
 
+/**
+ * @brief Finds the smallest block of the tree of large blocks that holds
+ *        the given size, the lowest such block if there are several.
+ *
+ * @param[in] node The root of the tree
+ * @param[in] asize The requested size of the block
+ * @return A free block, or NULL if none is large enough
+ */
+static block_t *tree_find(block_t *node, size_t asize) {
+    block_t *best = NULL;
+    while (node != NULL) {
+        arena->stats.fit_scanned++;
+        if (get_size(node) >= asize) {
+            best = node;
+            node = get_left(node);
+        } else {
+            node = get_right(node);
+        }
+    }
+    return best;
+}
 
 /**
  * @brief Inserts a block to the start of the free list
  *
+ * Mini blocks all land in one list, which is singly linked through `succ`.
+ * A block right before an epilogue becomes the arena's wilderness instead,
+ * if it has none.
+ *
  * @param[in] block The block to be inserted to the free list
  * @return void
  * @pre The block is free, and not in free list
@@ -418,60 +1365,140 @@ static int find_index(size_t size) {
  */
 static void insert_to_free_list(block_t *block) {
     dbg_requires(!get_alloc(block));
-    
+
+    // A free block at the top of the heap becomes the wilderness if there
+    // is none
+    if (arena->top == NULL && get_size(find_next(block)) == 0) {
+        arena->top = block;
+        return;
+    }
+
     int i = find_index(get_size(block));
+    set_list_bit(i);
+    if (i == tree_list) {
+        arena->segregated_list[i] =
+            tree_insert(arena->segregated_list[i], block);
+        return;
+    }
+    if (get_size(block) == mini_block_size) {
+        set_succ(block, arena->segregated_list[i]);
+        arena->segregated_list[i] = block;
+        return;
+    }
+
     // if the free list is empty, the block is now the start of the list
-    if (segregated_list[i] == NULL) {
-        block->pred = NULL;
-        block->succ = NULL;
-        segregated_list[i] = block;
+    if (arena->segregated_list[i] == NULL) {
+        set_pred(block, NULL);
+        set_succ(block, NULL);
+        arena->segregated_list[i] = block;
     } 
     
     // if the free list is non-empty, insert the block to the front
     else {
-        block->pred = NULL;
-        block->succ = segregated_list[i];
-        segregated_list[i]->pred = block;
-        segregated_list[i] = block;
+        set_pred(block, NULL);
+        set_succ(block, arena->segregated_list[i]);
+        set_pred(arena->segregated_list[i], block);
+        arena->segregated_list[i] = block;
+    }
+}
+
+/**
+ * @brief Removes a mini block from the singly linked mini block list
+ *
+ * Mini blocks have no `pred`, so this walks the list to find the block
+ * linking to the one being removed.
+ *
+ * @param[in] block The mini block to be removed from the free list
+ * @return void
+ * @pre The block is a free mini block in the free list
+ */
+static void remove_from_mini_list(block_t *block) {
+    int i = find_index(mini_block_size);
+    if (arena->segregated_list[i] == block) {
+        arena->segregated_list[i] = get_succ(block);
+        if (arena->segregated_list[i] == NULL) {
+            clear_list_bit(i);
+        }
+        return;
+    }
+
+    block_t *prev_block = arena->segregated_list[i];
+    while (get_succ(prev_block) != block) {
+        prev_block = get_succ(prev_block);
+        dbg_assert(prev_block != NULL);
     }
+    set_succ(prev_block, get_succ(block));
 }
 
 /**
  * @brief Removes a block from the free list
  *
- * @param[in] block The block to be removed from the free list
+ * @param[in] block The block to be removed from the free list, or the
+ *            wilderness
  * @return void
  * @pre The block is free
  */
 static void remove_from_free_list(block_t *block) {
-    block_t *prev_block = block->pred;
-    block_t *next_block = block->succ;
+    if (block == arena->top) {
+        arena->top = NULL;
+        return;
+    }
+    if (get_size(block) == mini_block_size) {
+        remove_from_mini_list(block);
+        return;
+    }
+
     int i = find_index(get_size(block));
+    if (i == tree_list) {
+        arena->segregated_list[i] =
+            tree_remove(arena->segregated_list[i], block);
+        if (arena->segregated_list[i] == NULL) {
+            clear_list_bit(i);
+        }
+        return;
+    }
+
+    block_t *prev_block = get_pred(block);
+    block_t *next_block = get_succ(block);
 
     // case 1: no prev & next block; the free list is now empty
     if (prev_block == NULL && next_block == NULL) {
-        segregated_list[i] = NULL;
+        arena->segregated_list[i] = NULL;
+        clear_list_bit(i);
     }
 
     // case 2: no prev free block; next free block is now the first
     else if (prev_block == NULL) {
-        next_block->pred = NULL;
-        segregated_list[i] = next_block;
+        set_pred(next_block, NULL);
+        arena->segregated_list[i] = next_block;
     }
 
     // case 3: no next free block; prev free block is now the last
     else if (next_block == NULL) {
-        prev_block->succ = NULL;
+        set_succ(prev_block, NULL);
     }
 
     // case 4: prev & next block exist
     else {
-        next_block->pred = prev_block;
-        prev_block->succ = next_block;
+        set_pred(next_block, prev_block);
+        set_succ(prev_block, next_block);
     }
 }
 
 
+/**
+ * @brief Moves the start of the known-zero top of the current arena above a
+ *        block whose header and links are about to become payload.
+ *
+ * @param[in] block A free block, or the block being freed
+ */
+static void raise_zero_start(block_t *block) {
+    char *end = (char *)block + sizeof(block_t);
+    if (end > arena->zero_start) {
+        arena->zero_start = end;
+    }
+}
+
 /**
  * @brief Combines the previous and/or next blocks if they are free.
  *
@@ -481,19 +1508,10 @@ static void remove_from_free_list(block_t *block) {
  * @post The new block is still free and in the free list.
  */
 static block_t *coalesce_block(block_t *block) {
-    bool prev_alloc, next_alloc;
-    // if the block is the first / last in the heap, can't coalesce
-    if (find_prev(block) == NULL) {
-        prev_alloc = true;
-    } else {
-        prev_alloc = get_alloc(find_prev(block));
-    }
-    
-    if (find_next(block) == NULL) {
-        next_alloc = true;
-    } else {
-        next_alloc = get_alloc(find_next(block));
-    }
+    // the prologue and epilogue are marked as allocated, so the first / last
+    // block in the heap can't coalesce past them
+    bool prev_alloc = get_prev_alloc(block);
+    bool next_alloc = get_alloc(find_next(block));
 
     size_t size = get_size(block);
 
@@ -505,9 +1523,10 @@ static block_t *coalesce_block(block_t *block) {
 
     // case2: prev block is allocated; next block is free
     else if (prev_alloc && !next_alloc) {
+        raise_zero_start(find_next(block));
         size += get_size(find_next(block));
         remove_from_free_list(find_next(block));
-        write_block(block, size, false);
+        write_block(block, size, true, get_prev_mini(block), false);
 
         // dbg_assert(mm_checkheap(__LINE__));
         return block;
@@ -515,71 +1534,245 @@ static block_t *coalesce_block(block_t *block) {
 
     // case3: prev block is free; next block is allocated
     else if (!prev_alloc && next_alloc) {
-        size += get_size(find_prev(block));
-        remove_from_free_list(find_prev(block));
-        write_block(find_prev(block), size, false);
-        
+        raise_zero_start(block);
+        block_t *block_prev = find_prev(block);
+        size += get_size(block_prev);
+        remove_from_free_list(block_prev);
+        write_block(block_prev, size, get_prev_alloc(block_prev),
+                    get_prev_mini(block_prev), false);
+
         // dbg_assert(mm_checkheap(__LINE__));
-        return find_prev(block);
+        return block_prev;
     }
 
     // case4: prev block and next block are free
     else {
-        size += get_size(find_prev(block)) + get_size(find_next(block));
-        remove_from_free_list(find_prev(block));
+        raise_zero_start(find_next(block));
+        block_t *block_prev = find_prev(block);
+        size += get_size(block_prev) + get_size(find_next(block));
+        remove_from_free_list(block_prev);
         remove_from_free_list(find_next(block));
-        write_block(find_prev(block), size, false);
-        
+        write_block(block_prev, size, get_prev_alloc(block_prev),
+                    get_prev_mini(block_prev), false);
+
         // dbg_assert(mm_checkheap(__LINE__));
-        return find_prev(block);
+        return block_prev;
+    }
+}
+
+/**
+ * @brief Acquires the lock serializing calls to mem_sbrk, mem_map and
+ *        mem_unmap.
+ */
+static void lock_sbrk(void) {
+#if MM_THREADS
+    pthread_mutex_lock(&sbrk_lock);
+#endif
+}
+
+/**
+ * @brief Releases the lock serializing calls to mem_sbrk, mem_map and
+ *        mem_unmap.
+ */
+static void unlock_sbrk(void) {
+#if MM_THREADS
+    pthread_mutex_unlock(&sbrk_lock);
+#endif
+}
+
+/**
+ * @brief Finds the arena a block or slab slot belongs to.
+ *
+ * @param[in] bp A pointer into the heap
+ * @return The arena owning the arena heap holding bp, or arena 0
+ */
+static arena_t *payload_arena(void *bp) {
+    size_t h = (size_t)((char *)bp - (char *)mem_heap_lo()) / arena_heap_size;
+    return (h < arena_heap_count) ? &arenas[arena_heap_owner[h]] : &arenas[0];
+}
+
+/**
+ * @brief Adds a new arena heap to the current arena, which is not arena 0.
+ *
+ * The arena heap is placed at the next arena_heap_size boundary above the
+ * top of the heap, and holds a prologue, one free block and an epilogue.
+ *
+ * @return The new free block, or NULL if the heap could not be extended or
+ *         the arena heap would lie outside arena_heap_owner
+ */
+static block_t *extend_arena_heap(void) {
+    lock_sbrk();
+    char *zero = max_address((char *)mem_heap_hi() + 1, mem_heap_zero());
+    size_t top = (size_t)((char *)mem_heap_hi() + 1 - (char *)mem_heap_lo());
+    size_t base = round_up(top, arena_heap_size);
+    if (base / arena_heap_size >= arena_heap_count ||
+        mem_sbrk((intptr_t)(base - top + arena_heap_size)) == (void *)-1) {
+        unlock_sbrk();
+        return NULL;
+    }
+    arena_heap_owner[base / arena_heap_size] = (uint8_t)(arena - arenas);
+    unlock_sbrk();
+    arena->stats.extensions++;
+
+    char *heap = (char *)mem_heap_lo() + base;
+    word_t *start = (word_t *)(heap + dsize - 2 * wsize);
+    start[0] = pack(0, true, false, true); // Prologue (block footer)
+    block_t *block = (block_t *)&start[1];
+    size_t size = arena_heap_size - dsize;
+    write_epilogue((block_t *)((char *)block + size), false, false);
+    write_block(block, size, true, false, false);
+
+    // The new block is the wilderness from now on
+    block_t *old_top = arena->top;
+    if (old_top != NULL) {
+        remove_from_free_list(old_top);
+    }
+    insert_to_free_list(block);
+    if (old_top != NULL) {
+        insert_to_free_list(old_top);
     }
+    arena->zero_start = zero;
+    return block;
 }
 
 /**
  * @brief Extends the heap with a new free block.
  *
+ * Arenas other than arena 0 get a new arena heap instead, if the size fits
+ * in one.
+ *
  * @param[in] size The size of extension
- * @return The extended block
+ * @return The extended block, or NULL if the heap could not be extended
  * @pre The size is non-negative.
  * @post The new block is free.
  */
 static block_t *extend_heap(size_t size) {
     void *bp;
 
+    if (arena != &arenas[0]) {
+        if (size > arena_heap_size - dsize) {
+            return NULL;
+        }
+        return extend_arena_heap();
+    }
+
     // Allocate an even number of words to maintain alignment
     size = round_up(size, dsize);
-    if ((bp = mem_sbrk((intptr_t)size)) == (void *)-1) {
+
+    // Arena heaps above the epilogue are covered by an allocated bridge
+    // block that starts at the epilogue and ends a word past them, where the
+    // new block starts
+    block_t *epilogue = heap_end;
+    lock_sbrk();
+    char *zero = max_address((char *)mem_heap_hi() + 1, mem_heap_zero());
+    size_t gap = (size_t)((char *)mem_heap_hi() + 1 - (char *)epilogue) - wsize;
+    size_t bridge = (gap == 0) ? 0 : gap + dsize;
+    // Every block must fit in a header, so neither can the heap grow past
+    // the largest size a header holds
+    if (size + bridge - gap > max_block_size - mem_heapsize()) {
+        unlock_sbrk();
         return NULL;
     }
+    bp = mem_sbrk((intptr_t)(size + bridge - gap));
+    unlock_sbrk();
+    if (bp == (void *)-1) {
+        return NULL;
+    }
+    arena->stats.extensions++;
+
+    // Create new epilogue header first, so that writing the block below can
+    // update its prev_alloc bit
+    block_t *block = (block_t *)((char *)epilogue + bridge);
+    block_t *block_next = (block_t *)((char *)block + size);
+    write_epilogue(block_next, false, false);
+    heap_end = block_next;
+
+    if (bridge > 0) {
+        write_block(block, size, true, false, false);
+        write_block(epilogue, bridge, get_prev_alloc(epilogue),
+                    get_prev_mini(epilogue), true);
+        // The wilderness is no longer at the top of the heap
+        block_t *top = arena->top;
+        if (top != NULL) {
+            remove_from_free_list(top);
+            insert_to_free_list(top);
+        }
+    } else {
+        // Initialize free block header/footer; the old epilogue header still
+        // records whether the last block was allocated or a mini block
+        write_block(block, size, get_prev_alloc(block), get_prev_mini(block),
+                    false);
+    }
 
-    // Initialize free block header/footer
-    block_t *block = payload_to_header(bp);
-    write_block(block, size, false);
-    //    insert_to_free_list(block);
-
-    // Create new epilogue header
-    block_t *block_next = find_next(block);
-    write_epilogue(block_next);
-
-    // Coalesce in case the previous block was free
+    // Coalesce in case the previous block was free, which enlarges the
+    // wilderness. The new memory is the known-zero top of the arena from
+    // then on.
     block = coalesce_block(block);
-    // ? insert
     insert_to_free_list(block);
+    arena->zero_start = zero;
 
     return block;
 }
 
+/**
+ * @brief Rounds up an extension of the heap of arena 0 so that a heap of at
+ *        least huge_threshold bytes ends on a huge page boundary.
+ *
+ * @param[in] size The number of bytes the heap needs to grow by
+ * @return The number of bytes to grow it by
+ */
+static size_t huge_round(size_t size) {
+    char *end = (char *)heap_end + wsize + size;
+    if (huge_threshold != 0 && (size_t)(end - heap_base) >= huge_threshold) {
+        size += round_up((uintptr_t)end, huge_page_size) - (uintptr_t)end;
+    }
+    return size;
+}
+
+/**
+ * @brief Chooses how much to extend the heap by for a request that no free
+ *        block fits, following growth_policy.
+ *
+ * @param[in] asize The adjusted size of the request
+ * @return The size of the extension
+ */
+static size_t growth_size(size_t asize) {
+    if (arena != &arenas[0]) {
+        return max(asize, chunksize);
+    }
+
+    size_t size = asize;
+    if (growth_policy != 0) {
+        // The new space is coalesced with the last block if that is free
+        if (!get_prev_alloc(heap_end)) {
+            size_t have = get_size(find_prev(heap_end));
+            size = (have < asize) ? asize - have : 0;
+        }
+
+        if (growth_policy == 2) {
+            size = max(size, growth_step);
+            growth_step = (2 * growth_step < growth_max) ? 2 * growth_step
+                                                         : growth_max;
+        }
+    }
+    return huge_round(max(size, chunksize));
+}
+
 /**
  * @brief Splits an allocated block into one allocated block of the given size,
  *         and the remaining space is a free block.
  *
+ * The remainder is coalesced with the next block in case that one is free,
+ * which happens when a block is split more than once.
+ *
  * @param[in] block The block to be splitted
  * @param[in] asize The allocated size of the block
+ * @param[in] purged Whether the pages of the block were purged while free
  * @return Void
  * @pre The requested size is no larger than the block size.
  * @post The block pointer remains the same.
  */
-static void split_block(block_t *block, size_t asize) {
+static void split_block(block_t *block, size_t asize, bool purged) {
     dbg_requires(get_alloc(block));
     /* TODO: Can you write a precondition about the value of asize? */
     dbg_requires(asize <= get_size(block));
@@ -587,42 +1780,1010 @@ static void split_block(block_t *block, size_t asize) {
     size_t block_size = get_size(block);
 
     if ((block_size - asize) >= min_block_size) {
-        block_t *block_next;
-        write_block(block, asize, true);
-
-        block_next = find_next(block);
-        write_block(block_next, block_size - asize, false);
-        // ????
+        // Write the remainder first, so that the header of the allocated
+        // part's next block is initialized when its prev_alloc bit is set
+        block_t *block_next = (block_t *)((char *)block + asize);
+        write_block(block_next, block_size - asize, true,
+                    asize == mini_block_size, false);
+        write_block(block, asize, get_prev_alloc(block), get_prev_mini(block),
+                    true);
+        // The pages of the remainder stay purged, unless it absorbs the
+        // links of a free next block
+        purged = purged && get_alloc(find_next(block_next));
+        block_next = coalesce_block(block_next);
+        if (purged) {
+            set_purged(block_next);
+        }
         insert_to_free_list(block_next);
     }
 
+    // The payload is the user's now, and may not stay zero
+    if ((char *)find_next(block) > arena->zero_start) {
+        arena->zero_start = (char *)find_next(block);
+    }
+
     dbg_ensures(get_alloc(block));
 }
 
 /**
- * @brief Find a free block large enough to hold the given size.
+ * @brief Splits an allocated block into a free block at its front, and an
+ *        allocated block of the given size at its end.
+ *
+ * Nothing is split off if the front would be smaller than a mini block.
+ *
+ * @param[in] block The block to be split
+ * @param[in] asize The allocated size of the block
+ * @param[in] purged Whether the pages of the block were purged while free
+ * @return The allocated block
+ * @pre The block is allocated, its previous block is allocated, and the
+ *      requested size is no larger than the block size.
+ * @post The returned block is allocated, and its size is asize if the block
+ *       was split.
+ */
+static block_t *split_block_high(block_t *block, size_t asize, bool purged) {
+    dbg_requires(get_alloc(block));
+    dbg_requires(asize <= get_size(block));
+
+    size_t block_size = get_size(block);
+    size_t lead = block_size - asize;
+    if (lead < min_block_size) {
+        return block;
+    }
+
+    // Write the allocated part first, so that its header is initialized
+    // when writing the free part updates its prev bits
+    block_t *block_high = (block_t *)((char *)block + lead);
+    write_block(block_high, asize, false, lead == mini_block_size, true);
+    write_block(block, lead, get_prev_alloc(block), get_prev_mini(block),
+                false);
+    if (purged) {
+        set_purged(block);
+    }
+    insert_to_free_list(block);
+
+    // The payload is the user's now, and may not stay zero
+    if ((char *)find_next(block_high) > arena->zero_start) {
+        arena->zero_start = (char *)find_next(block_high);
+    }
+
+    dbg_ensures(get_alloc(block_high));
+    return block_high;
+}
+
+/**
+ * @brief Find a free block large enough to hold the given size, in constant
+ *        time, with the TLSF engine.
+ *
+ * The size is first rounded up to the start of the next second-level list,
+ * so that every block in that list or any later one is large enough, and
+ * the head of the first non-empty such list is found with two bitmap
+ * lookups. This bounds the search at the cost of internal waste below one
+ * second-level step (1/8 of the size). Only if no such list exists is the
+ * head of the list asize itself maps to tried.
  *
  * @param[in] asize The requested size of the block
  * @return A free block, or NULL is not found
  * @pre The requested size is positive.
  * @post The returned block is free.
  */
-static block_t *find_fit(size_t asize) {
-    block_t *block;
-    int i = find_index(asize);
-
-    while (i < list_length) {
-        /* return when we reached the end of segregated list / found a fit block */
-        for (block = segregated_list[i]; block != NULL; block = block->succ) {
+static block_t *find_fit_tlsf(size_t asize) {
+    size_t rsize = asize;
+    if (asize >= tlsf_small_size) {
+        int msb = 63 - __builtin_clzl(asize);
+        rsize += ((size_t)1 << (msb - sl_log2)) - 1;
+    }
 
-            if (asize <= get_size(block) && !get_alloc(block)) {
+    int i = find_index(rsize);
+    int fl = i >> sl_log2;
+    int sl = i & ((1 << sl_log2) - 1);
+
+    uint32_t sl_map = arena->sl_bitmap[fl] & (~(uint32_t)0 << sl);
+    if (sl_map == 0) {
+        uint64_t fl_map = (fl + 1 < 64) ? arena->fl_bitmap & (~(uint64_t)0 << (fl + 1))
+                                        : 0;
+        if (fl_map == 0) {
+            block_t *block = arena->segregated_list[find_index(asize)];
+            if (block != NULL && asize <= get_size(block)) {
                 return block;
             }
+            return NULL; // no fit found
         }
-        i++;
+        fl = __builtin_ctzl(fl_map);
+        sl_map = arena->sl_bitmap[fl];
     }
 
-    return NULL; // no fit found
+    return arena->segregated_list[(fl << sl_log2) | __builtin_ctz(sl_map)];
+}
+
+/**
+ * @brief Scans a free list for a block large enough to hold the given size,
+ *        following the fit policy set by fit_limit.
+ *
+ * The tightest of the first fit_limit fitting blocks is kept, and the scan
+ * stops early on an exact fit. Every block examined is counted in
+ * arena->stats.fit_scanned.
+ *
+ * @param[in] block The first block of the free list
+ * @param[in] asize The requested size of the block
+ * @return The tightest fitting block found, or NULL if none fits
+ */
+static block_t *scan_list(block_t *block, size_t asize) {
+    block_t *best = NULL;
+    size_t best_size = 0;
+    size_t found = 0;
+
+    for (; block != NULL; block = get_succ(block)) {
+        arena->stats.fit_scanned++;
+        size_t size = get_size(block);
+        if (size < asize) {
+            continue;
+        }
+        if (size == asize) {
+            return block;
+        }
+        if (best == NULL || size < best_size) {
+            best = block;
+            best_size = size;
+        }
+        if (++found == fit_limit) {
+            break;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * @brief Find a free block large enough to hold the given size.
+ *
+ * Only the list asize maps to and the next non-empty larger list (found
+ * from the occupancy bitmap) need scanning: every block in a larger list is
+ * bigger than any size in the list asize maps to, and the lists beyond the
+ * next non-empty one only hold looser fits.
+ *
+ * @param[in] asize The requested size of the block
+ * @return A free block, or NULL is not found
+ * @pre The requested size is positive.
+ * @post The returned block is free.
+ */
+static block_t *find_fit(size_t asize) {
+    arena->stats.fit_searches++;
+    if (MM_TLSF) {
+        arena->stats.fit_scanned++;
+        return find_fit_tlsf(asize);
+    }
+
+    block_t *block;
+    int i = find_index(asize);
+
+    if (i == tree_list) {
+        return tree_find(arena->segregated_list[i], asize);
+    }
+    block = scan_list(arena->segregated_list[i], asize);
+    if (block != NULL) {
+        return block;
+    }
+
+    /* jump to the first non-empty larger list */
+    uint64_t larger = arena->fl_bitmap & ~(((uint64_t)2 << i) - 1);
+    if (larger == 0) {
+        return NULL; // no fit found
+    }
+    i = __builtin_ctzl(larger);
+    if (i == tree_list) {
+        return tree_find(arena->segregated_list[i], asize);
+    }
+    return scan_list(arena->segregated_list[i], asize);
+}
+
+/**
+ * @brief Find a free block large enough to hold the given size, carving it
+ *        out of the wilderness if no listed block fits.
+ *
+ * Keeping the wilderness last preserves it for requests nothing else fits,
+ * and while the heap only grows, serving them splits its front off with no
+ * list operations at all: the remainder simply becomes the wilderness.
+ *
+ * @param[in] asize The requested size of the block
+ * @return A free block, or NULL if not found
+ */
+static block_t *find_fit_or_top(size_t asize) {
+    block_t *block = find_fit(asize);
+    if (block == NULL && arena->top != NULL && get_size(arena->top) >= asize) {
+        block = arena->top;
+        arena->stats.top_hits++;
+    }
+    return block;
+}
+
+/**
+ * @brief Gives the end of a large free block at the top of the heap back to
+ *        memlib.
+ *
+ * Only arena 0 grows with sbrk, so only its heap is trimmed, and only while
+ * no arena heap lies above it.
+ *
+ * @param[in] block A free block in the free list
+ */
+static void trim_heap(block_t *block) {
+    size_t size = get_size(block);
+    if (trim_threshold == 0 || size <= trim_threshold ||
+        arena != &arenas[0] || find_next(block) != heap_end) {
+        return;
+    }
+
+    // Large heaps keep ending on a huge page boundary
+    size_t keep = chunksize;
+    char *end = (char *)heap_end + wsize - size + keep;
+    if (huge_threshold != 0 && (size_t)(end - heap_base) >= huge_threshold) {
+        keep += round_up((uintptr_t)end, huge_page_size) - (uintptr_t)end;
+    }
+    if (size <= keep) {
+        return;
+    }
+
+    size_t release = size - keep;
+    lock_sbrk();
+    bool trimmed = (char *)heap_end == (char *)mem_heap_hi() + 1 - wsize &&
+                   mem_sbrk(-(intptr_t)release) != (void *)-1;
+    unlock_sbrk();
+    if (!trimmed) {
+        return;
+    }
+
+    // Write the new epilogue first, so that shrinking the block can update
+    // its prev bits
+    remove_from_free_list(block);
+    heap_end = (block_t *)((char *)heap_end - release);
+    write_epilogue(heap_end, false, false);
+    write_block(block, keep, get_prev_alloc(block), get_prev_mini(block),
+                false);
+    insert_to_free_list(block);
+    arena->stats.trimmed_bytes += release;
+    growth_step = chunksize;
+}
+
+/**
+ * @brief Gives the pages of a free block that lie in a range back to
+ *        memlib, and flags the block as purged.
+ *
+ * The links at the start of the block and its footer are kept, so only the
+ * whole pages between them are discarded. Pages the range only partly
+ * covers are discarded too, so that afterwards every such page is purged.
+ *
+ * @param[in] block A free block
+ * @param[in] lo The first byte of the block that may be dirty
+ * @param[in] hi The end of the bytes of the block that may be dirty
+ */
+static void purge_block(block_t *block, char *lo, char *hi) {
+    size_t page = mem_pagesize();
+    char *start = (char *)round_up((uintptr_t)block + sizeof(block_t), page);
+    char *end = (char *)header_to_footer(block);
+    end -= (uintptr_t)end % page;
+    lo -= (uintptr_t)lo % page;
+    hi = (char *)round_up((uintptr_t)hi, page);
+    start = max_address(start, lo);
+    if (hi < end) {
+        end = hi;
+    }
+
+    if (start < end) {
+        lock_sbrk();
+        mem_discard(start, (size_t)(end - start));
+        unlock_sbrk();
+        arena->stats.purged_bytes += (size_t)(end - start);
+    }
+    set_purged(block);
+}
+
+/**
+ * @brief Frees an allocated block, coalescing it with free neighbors.
+ *
+ * @param[in] block The block to be freed
+ * @return The size of the free block it was merged into, before trimming
+ * @pre The block is allocated
+ * @post The block, possibly merged with its neighbors, is in the free list
+ */
+static size_t free_block(block_t *block) {
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
+
+    // Once coalesced, only the pages of this block and of the neighbors
+    // that are not purged yet may need purging
+    char *dirty_lo = (char *)block;
+    char *dirty_hi = (char *)find_next(block);
+    bool prev_dirty = !get_prev_alloc(block) && !get_purged(find_prev(block));
+    bool next_dirty =
+        !get_alloc(find_next(block)) && !get_purged(find_next(block));
+
+    // Mark the block as free
+    write_block(block, get_size(block), get_prev_alloc(block),
+                get_prev_mini(block), false);
+
+    // Try to coalesce the block with its neighbors
+    block = coalesce_block(block);
+    insert_to_free_list(block);
+    size_t size = get_size(block);
+    trim_heap(block);
+
+    // The wilderness is trimmed instead. A purged neighbor's footer or
+    // header and links are dirty, and inside the merged block now.
+    if (purge_threshold != 0 && size >= purge_threshold &&
+        block != arena->top) {
+        purge_block(block, prev_dirty ? (char *)block : dirty_lo - wsize,
+                    next_dirty ? (char *)find_next(block)
+                               : dirty_hi + sizeof(block_t));
+    }
+    return size;
+}
+
+/**
+ * @brief Coalesces every block of the quick lists into the free lists.
+ *
+ * @return True if any block was flushed
+ */
+static bool quick_flush(void) {
+    bool flushed = false;
+    for (size_t q = 0; q <= quick_max / dsize; q++) {
+        while (arena->quick_lists[q] != NULL) {
+            block_t *block = arena->quick_lists[q];
+            arena->quick_lists[q] = get_succ(block);
+            free_block(block);
+            flushed = true;
+        }
+        arena->quick_counts[q] = 0;
+    }
+    if (flushed) {
+        arena->stats.quick_flushes++;
+    }
+    return flushed;
+}
+
+/**
+ * @brief Keeps a freed block on its quick list, flushing the lists first if
+ *        it is full.
+ *
+ * Blocks right below the wilderness are not kept, so that freeing them
+ * grows it instead of keeping it from being trimmed.
+ *
+ * @param[in] block An allocated block
+ * @param[in] size The size of the block
+ * @return True if the block was kept, false if it is too large or borders
+ *         the wilderness
+ */
+static bool quick_push(block_t *block, size_t size) {
+    dbg_requires(size == get_size(block));
+    if (size > quick_max || (block_t *)((char *)block + size) == arena->top) {
+        return false;
+    }
+
+    size_t q = size / dsize - 1;
+    if (arena->quick_counts[q] == quick_limit) {
+        quick_flush();
+    }
+    set_succ(block, arena->quick_lists[q]);
+    arena->quick_lists[q] = block;
+    arena->quick_counts[q]++;
+    return true;
+}
+
+/**
+ * @brief Takes a block of the given size off its quick list.
+ *
+ * @param[in] asize The adjusted size of the block
+ * @return An allocated block of asize bytes, or NULL if there is none
+ */
+static block_t *quick_pop(size_t asize) {
+    if (asize > quick_max) {
+        return NULL;
+    }
+
+    size_t q = asize / dsize - 1;
+    block_t *block = arena->quick_lists[q];
+    if (block != NULL) {
+        arena->quick_lists[q] = get_succ(block);
+        arena->quick_counts[q]--;
+        arena->stats.quick_hits++;
+    }
+    return block;
+}
+
+/**
+ * @brief Allocates a block of the given adjusted size, extending the heap if
+ *        no fit is found.
+ *
+ * @param[in] asize The adjusted size of the block
+ * @return The allocated block, or NULL if the heap could not be extended
+ * @pre asize is a multiple of dsize, and at least min_block_size
+ * @post The returned block is allocated, and its size is at least asize
+ */
+static block_t *malloc_block(size_t asize) {
+    size_t extendsize; // Amount to extend heap if no fit is found
+
+    // Search the free list for a fit, then the wilderness, and both again
+    // once the quick lists have been coalesced if there is none
+    block_t *block = find_fit_or_top(asize);
+    if (block == NULL && quick_flush()) {
+        block = find_fit_or_top(asize);
+    }
+
+    // If no fit is found, request more memory, and then and place the block
+    if (block == NULL) {
+        extendsize = growth_size(asize);
+        block = extend_heap(extendsize);
+        // The new space does not follow the last block if another arena has
+        // grown the heap since
+        if (block != NULL && get_size(block) < asize) {
+            block = extend_heap(max(asize, chunksize));
+        }
+        // extend_heap returns an error
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    // The block should be marked as free
+    dbg_assert(!get_alloc(block));
+
+    // Large requests take the high end of a free block, but the front of
+    // the wilderness, which stays at the top of the heap
+    bool high = place_high_min != 0 && asize >= place_high_min &&
+                block != arena->top;
+
+    // Mark block as allocated
+    size_t block_size = get_size(block);
+    bool purged = get_purged(block);
+    write_block(block, block_size, get_prev_alloc(block), get_prev_mini(block),
+                true);
+    remove_from_free_list(block);
+
+    // Record which bytes of the payload are known to be zero: those in the
+    // known-zero top, but for the links and the footer of the free block
+    char *footer = (char *)header_to_footer(block);
+    zero_lo = max_address((char *)block + sizeof(block_t), arena->zero_start);
+
+    // and the purged pages, if they read as zero
+    if (purged && mem_discard_zeroes()) {
+        size_t page = mem_pagesize();
+        char *page_lo =
+            (char *)round_up((uintptr_t)block + sizeof(block_t), page);
+        char *page_hi = footer - (uintptr_t)footer % page;
+        if (page_lo < page_hi && page_lo < zero_lo) {
+            // The known-zero top may not reach down to the purged pages
+            if (zero_lo > page_hi) {
+                footer = page_hi;
+            }
+            zero_lo = page_lo;
+        }
+    }
+
+    // Try to split the block if too large
+    if (high) {
+        block = split_block_high(block, asize, purged);
+        zero_lo = max_address(zero_lo, header_to_payload(block));
+    } else {
+        split_block(block, asize, purged);
+    }
+
+    zero_hi = (char *)find_next(block);
+    if (zero_hi > footer) {
+        zero_hi = footer;
+    }
+    return block;
+}
+
+/**
+ * @brief Resizes an allocated block in place, if possible.
+ *
+ * A block shrinks by splitting off its tail, and grows by absorbing a free
+ * next block. The last block of the heap of arena 0 grows by extending the
+ * heap by just the missing bytes.
+ *
+ * @param[in] block The block to be resized
+ * @param[in] asize The new adjusted size of the block
+ * @return True if the block now has at least asize bytes, false if it is
+ *         unchanged because it cannot grow in place
+ * @pre The block is allocated, and belongs to the current arena
+ */
+static bool resize_block(block_t *block, size_t asize) {
+    dbg_requires(get_alloc(block));
+
+    size_t size = get_size(block);
+    block_t *next = find_next(block);
+    size_t next_size = get_alloc(next) ? 0 : get_size(next);
+
+    if (size + next_size < asize) {
+        // Only the top of arena 0 can grow, and only if nothing but a
+        // free block lies between this block and the epilogue
+        block_t *last = (next_size > 0) ? find_next(next) : next;
+        if (arena != &arenas[0] || last != heap_end) {
+            return false;
+        }
+        block_t *grown = extend_heap(asize - size - next_size);
+        if (grown == NULL || grown != find_next(block)) {
+            // Arena heaps were in the way, so the new space was not placed
+            // right after the block
+            return false;
+        }
+        next = grown;
+        next_size = get_size(next);
+    }
+
+    // The tail split off a grown block lies in the absorbed one
+    bool purged = false;
+    if (next_size > 0 && size < asize) {
+        purged = get_purged(next);
+        remove_from_free_list(next);
+        write_block(block, size + next_size, get_prev_alloc(block),
+                    get_prev_mini(block), true);
+    }
+    split_block(block, asize, purged);
+    dbg_ensures(mm_checkheap(__LINE__));
+    return true;
+}
+
+/**
+ * @brief Returns the number of bytes between the payload of a block and the
+ *        next address aligned to align bytes.
+ *
+ * Payloads are dsize-aligned, so this is either 0 or at least a mini block;
+ * a fragment smaller than min_block_size is skipped to the next aligned
+ * address.
+ *
+ * @param[in] block A block in the heap, or the epilogue
+ * @param[in] align The alignment (a power of two)
+ * @return The size of the fragment in front of the aligned payload
+ */
+static size_t aligned_lead(block_t *block, size_t align) {
+    uintptr_t payload = (uintptr_t)block + wsize;
+    size_t lead = (size_t)(round_up(payload, align) - payload);
+    // A fragment too small to be a block is skipped to the next boundary
+    if (lead != 0 && lead < min_block_size) {
+        lead += align;
+    }
+    return lead;
+}
+
+/**
+ * @brief Returns the largest value aligned_lead may return.
+ *
+ * With mini blocks every fragment is a block, so the lead stays below align.
+ * Otherwise a fragment smaller than min_block_size adds align to it.
+ *
+ * @param[in] align The alignment (a power of two, larger than dsize)
+ * @return The largest fragment in front of an aligned payload
+ */
+static size_t max_aligned_lead(size_t align) {
+    if (min_block_size == dsize) {
+        return align - dsize;
+    }
+    return align + (min_block_size - dsize);
+}
+
+/**
+ * @brief Find a free block holding asize bytes at a payload aligned to
+ *        align bytes.
+ *
+ * This is a first fit over the lists from the one asize maps to upward,
+ * since a block may fit the size but not the alignment. In the tree of large
+ * blocks, the best fit for the size plus the largest possible lead is taken.
+ * TLSF looks up a block of that size directly, so that slab runs and aligned
+ * requests keep its constant-time bound. The wilderness is only used if no
+ * listed block fits.
+ *
+ * @param[in] asize The requested size of the block
+ * @param[in] align The alignment of the payload (a power of two)
+ * @return A free block, or NULL is not found
+ */
+static block_t *find_aligned_fit(size_t asize, size_t align) {
+    if (MM_TLSF) {
+        block_t *block = find_fit_tlsf(asize + max_aligned_lead(align));
+        if (block != NULL) {
+            return block;
+        }
+    }
+
+    // Under TLSF, only the wilderness is left to try
+    uint64_t lists = 0;
+    if (!MM_TLSF) {
+        int first = find_index(asize) >> sl_log2;
+        lists = arena->fl_bitmap & ~(((uint64_t)1 << first) - 1);
+    }
+    while (lists != 0) {
+        int fl = __builtin_ctzl(lists);
+        for (int i = fl << sl_log2; i < (fl + 1) << sl_log2; i++) {
+            if (i == tree_list) {
+                // Any block this large holds an aligned fit. The tree is the
+                // last list, so if it has none, only the wilderness is left.
+                block_t *block = tree_find(arena->segregated_list[i],
+                                           asize + max_aligned_lead(align));
+                if (block != NULL) {
+                    return block;
+                }
+                break;
+            }
+            for (block_t *block = arena->segregated_list[i]; block != NULL;
+                 block = get_succ(block)) {
+                if (aligned_lead(block, align) + asize <= get_size(block)) {
+                    return block;
+                }
+            }
+        }
+        lists &= lists - 1;
+    }
+
+    block_t *top = arena->top;
+    if (top != NULL && aligned_lead(top, align) + asize <= get_size(top)) {
+        return top;
+    }
+    return NULL; // no fit found
+}
+
+/**
+ * @brief Allocates a block of the given adjusted size whose payload is
+ *        aligned to align bytes.
+ *
+ * If no free block holds an aligned fit, the heap is extended just enough
+ * for the block at its top to hold one. The fragment in front of the aligned
+ * payload is either empty or at least a mini block; it is split off and
+ * freed, and the tail beyond asize is split off by split_block as usual.
+ *
+ * @param[in] asize The adjusted size of the block
+ * @param[in] align The alignment of the payload (a power of two)
+ * @return The allocated block, or NULL if the heap could not be extended
+ * @pre align is a power of two, and at least dsize
+ * @post The returned block is allocated, and its payload is aligned
+ */
+static block_t *malloc_aligned_block(size_t asize, size_t align) {
+    dbg_requires(align >= dsize && (align & (align - 1)) == 0);
+
+    block_t *block = find_aligned_fit(asize, align);
+    if (block == NULL && quick_flush()) {
+        block = find_aligned_fit(asize, align);
+    }
+    // The new space is coalesced with the last block if that is free. That
+    // block may already hold an aligned fit that the searches allowing for
+    // the largest possible lead missed.
+    size_t extendsize = asize + max_aligned_lead(align);
+    if (block == NULL && arena == &arenas[0]) {
+        block_t *last = get_prev_alloc(heap_end) ? heap_end
+                                                 : find_prev(heap_end);
+        size_t have = (last == heap_end) ? 0 : get_size(last);
+        size_t need = aligned_lead(last, align) + asize;
+        if (need <= have) {
+            block = last;
+        }
+        extendsize = huge_round(need - have);
+    }
+    if (block == NULL) {
+        block = extend_heap(extendsize);
+        // The new space does not follow the last block if another arena
+        // has grown the heap since, and then the lead may differ
+        if (block != NULL &&
+            aligned_lead(block, align) + asize > get_size(block)) {
+            block = extend_heap(asize + max_aligned_lead(align));
+        }
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    // Mark block as allocated
+    bool purged = get_purged(block);
+    write_block(block, get_size(block), get_prev_alloc(block),
+                get_prev_mini(block), true);
+    remove_from_free_list(block);
+
+    size_t lead = aligned_lead(block, align);
+    if (lead > 0) {
+        // Write the aligned block first, so that its header is initialized
+        // when freeing the leading fragment updates its prev bits
+        block_t *block_aligned = (block_t *)((char *)block + lead);
+        write_block(block_aligned, get_size(block) - lead, false,
+                    lead == mini_block_size, true);
+        write_block(block, lead, get_prev_alloc(block), get_prev_mini(block),
+                    true);
+        free_block(block);
+        block = block_aligned;
+    }
+
+    split_block(block, asize, purged);
+
+    dbg_ensures((uintptr_t)header_to_payload(block) % align == 0);
+    return block;
+}
+
+/**
+ * @brief Finds the slab size class serving requests of the given size.
+ *
+ * Classes are 16 bytes apart up to 128 bytes, 32 bytes apart up to 256
+ * bytes and 64 bytes apart up to 512 bytes.
+ *
+ * @param[in] size The requested size
+ * @return The slab size class
+ * @pre 0 < size <= 512
+ */
+static int slab_class(size_t size) {
+    if (size <= 128) {
+        return (int)((size - 1) / 16);
+    }
+    if (size <= 256) {
+        return 8 + (int)((size - 129) / 32);
+    }
+    return 12 + (int)((size - 257) / 64);
+}
+
+/**
+ * @brief Returns whether a payload pointer lies in a slab run.
+ *
+ * @param[in] bp A pointer returned by malloc
+ * @return True if bp is a slot of a slab run (or a run header)
+ */
+static bool is_run_payload(void *bp) {
+    size_t offset = (size_t)((char *)bp - (char *)mem_heap_lo());
+    if (offset >= run_map_span) {
+        return false;
+    }
+    size_t page = offset / run_size;
+    // Other arenas mark their runs in the same words without this lock
+    return (__atomic_load_n(&run_page_map[page / 64], __ATOMIC_RELAXED) >>
+            (page % 64)) &
+           1;
+}
+
+/**
+ * @brief Finds the run a slot belongs to by masking its address.
+ *
+ * @param[in] bp A slot of a slab run
+ * @return The run header
+ */
+static run_t *slot_to_run(void *bp) {
+    return (run_t *)((uintptr_t)bp & ~(uintptr_t)(run_size - 1));
+}
+
+/**
+ * @brief Returns the address of the first slot of a run.
+ * @param[in] run
+ * @return The first slot, which follows the run header
+ */
+static char *run_slots(run_t *run) {
+    return (char *)run + round_up(sizeof(run_t), dsize);
+}
+
+/**
+ * @brief Returns the number of slots in a run of the given size class.
+ * @param[in] size_class
+ * @return The number of slots
+ */
+static uint32_t run_nslots(int size_class) {
+    return (uint32_t)((run_size - wsize - round_up(sizeof(run_t), dsize)) /
+                      slab_sizes[size_class]);
+}
+
+/**
+ * @brief Marks the pages of a run in run_page_map.
+ *
+ * @param[in] run
+ * @param[in] is_run True to mark the pages as a run, false to clear them
+ */
+static void mark_run_pages(run_t *run, bool is_run) {
+    size_t page = (size_t)((char *)run - (char *)mem_heap_lo()) / run_size;
+    // Arenas share the words of the map, and read it without their locks
+    if (is_run) {
+        __atomic_fetch_or(&run_page_map[page / 64], (uint64_t)1 << (page % 64),
+                          __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&run_page_map[page / 64],
+                           ~((uint64_t)1 << (page % 64)), __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Adds a run to the front of the list of runs of its class with
+ *        free slots.
+ * @param[in] run
+ */
+static void push_run(run_t *run) {
+    int c = (int)run->size_class;
+    run->prev = NULL;
+    run->next = arena->slab_runs[c];
+    if (arena->slab_runs[c] != NULL) {
+        arena->slab_runs[c]->prev = run;
+    }
+    arena->slab_runs[c] = run;
+}
+
+/**
+ * @brief Removes a run from the list of runs of its class with free slots.
+ * @param[in] run
+ */
+static void unlink_run(run_t *run) {
+    if (run->prev != NULL) {
+        run->prev->next = run->next;
+    } else {
+        arena->slab_runs[run->size_class] = run->next;
+    }
+    if (run->next != NULL) {
+        run->next->prev = run->prev;
+    }
+}
+
+/**
+ * @brief Carves a new run for a slab size class out of the heap.
+ *
+ * @param[in] size_class
+ * @return The new run, with all slots free, or NULL if the heap could not
+ *         be extended or the run would lie outside run_page_map
+ */
+static run_t *create_run(int size_class) {
+    block_t *block = malloc_aligned_block(run_size, run_size);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    run_t *run = (run_t *)header_to_payload(block);
+    if ((size_t)((char *)run - (char *)mem_heap_lo()) + run_size >
+        run_map_span) {
+        free_block(block);
+        return NULL;
+    }
+
+    uint32_t nslots = run_nslots(size_class);
+    run->size_class = (uint32_t)size_class;
+    run->nfree = nslots;
+    for (uint32_t w = 0; w < 4; w++) {
+        uint32_t bits = (nslots > 64 * w) ? nslots - 64 * w : 0;
+        run->free_map[w] = (bits >= 64) ? ~(uint64_t)0
+                                        : (((uint64_t)1 << bits) - 1);
+    }
+
+    mark_run_pages(run, true);
+    push_run(run);
+    return run;
+}
+
+/**
+ * @brief Allocates a slot of a slab run.
+ *
+ * The first run of the class with free slots is used, and its first free
+ * slot is found with a count-trailing-zeros on the free-slot bitmap.
+ *
+ * @param[in] size The requested size
+ * @return A pointer to the slot, or NULL if no run could be created
+ * @pre 0 < size <= slab_max
+ */
+static void *slab_malloc(size_t size) {
+    int c = slab_class(size);
+    run_t *run = arena->slab_runs[c];
+    if (run == NULL) {
+        run = create_run(c);
+        if (run == NULL) {
+            return NULL;
+        }
+    }
+
+    int w = 0;
+    while (run->free_map[w] == 0) {
+        w++;
+    }
+    int bit = __builtin_ctzl(run->free_map[w]);
+    run->free_map[w] &= ~((uint64_t)1 << bit);
+
+    // A full run leaves the list until one of its slots is freed
+    if (--run->nfree == 0) {
+        unlink_run(run);
+    }
+
+    return run_slots(run) + (size_t)(64 * w + bit) * slab_sizes[c];
+}
+
+/**
+ * @brief Frees a slot of a slab run.
+ *
+ * A run whose slots are all free is returned to the heap, unless it is the
+ * only run of its class with free slots.
+ *
+ * @param[in] bp A slot of a slab run
+ * @pre bp is an allocated slot
+ */
+static void slab_free(void *bp) {
+    run_t *run = slot_to_run(bp);
+    size_t slot_size = slab_sizes[run->size_class];
+    size_t slot = (size_t)((char *)bp - run_slots(run)) / slot_size;
+    dbg_requires(run_slots(run) + slot * slot_size == (char *)bp);
+    dbg_requires(!((run->free_map[slot / 64] >> (slot % 64)) & 1));
+
+    run->free_map[slot / 64] |= (uint64_t)1 << (slot % 64);
+    if (run->nfree++ == 0) {
+        push_run(run);
+    }
+
+    if (run->nfree == run_nslots((int)run->size_class) &&
+        (run->prev != NULL || run->next != NULL)) {
+        unlink_run(run);
+        mark_run_pages(run, false);
+        free_block(payload_to_header(run));
+    }
+}
+
+/**
+ * @brief Returns the number of usable bytes at a payload pointer.
+ *
+ * @param[in] bp A pointer returned by malloc
+ * @return The slot size for slab slots, the payload size otherwise
+ */
+static size_t get_usable_size(void *bp) {
+    if (is_run_payload(bp)) {
+        return slab_sizes[slot_to_run(bp)->size_class];
+    }
+    return get_payload_size(payload_to_header(bp));
+}
+
+/**
+ * @brief Returns whether a payload pointer is a block with its own mapped
+ *        region.
+ *
+ * @param[in] bp A pointer returned by malloc
+ * @return True if bp was returned by map_block
+ */
+static bool is_mapped_payload(void *bp) {
+    // The header is read without the lock, like in get_size
+    return !is_run_payload(bp) &&
+           (__atomic_load_n(&payload_to_header(bp)->header, __ATOMIC_RELAXED) &
+            mapped_mask);
+}
+
+/**
+ * @brief Allocates a block in a region of its own, outside of the heap.
+ *
+ * The header is placed one word before the first aligned payload of the
+ * region, and the block takes the rest of the region but for the last word.
+ *
+ * @param[in] size The requested size
+ * @return A payload of at least size bytes, or NULL if no region could be
+ *         mapped
+ * @pre size > 0
+ */
+static void *map_block(size_t size) {
+    size_t len = round_up(size + dsize + wsize, mem_pagesize());
+    if (len - dsize > max_block_size) {
+        return NULL;
+    }
+    lock_sbrk();
+    void *region = mem_map(len);
+    unlock_sbrk();
+    if (region == (void *)-1) {
+        return NULL;
+    }
+
+    block_t *block = (block_t *)((char *)region + dsize - wsize);
+    block->header = pack(len - dsize, true, false, true) | mapped_mask;
+
+    // The region is fresh, so the whole payload is zero
+    zero_lo = header_to_payload(block);
+    zero_hi = zero_lo + get_payload_size(block);
+    return header_to_payload(block);
+}
+
+/**
+ * @brief Frees a block returned by map_block, unmapping its region.
+ *
+ * Requests as large as the block are served from the heap from then on, up
+ * to map_threshold_max.
+ *
+ * @param[in] bp A pointer to the block payload
+ */
+static void unmap_block(void *bp) {
+    block_t *block = payload_to_header(bp);
+    size_t size = get_payload_size(block);
+    if (size > __atomic_load_n(&map_threshold, __ATOMIC_RELAXED) &&
+        size <= map_threshold_max) {
+        __atomic_store_n(&map_threshold, size, __ATOMIC_RELAXED);
+    }
+
+    lock_sbrk();
+    mem_unmap((char *)block - (dsize - wsize));
+    unlock_sbrk();
 }
 
 /**
@@ -630,312 +2791,1094 @@ static block_t *find_fit(size_t asize) {
  * @param[in] prologue, epilogue
  * @return true if they are good
  */
-static bool check_prologue_epilogue(block_t *block) {
-    if (!get_alloc(block)) {
-        dbg_printf("prologue/epilogue allocated \n");
+static bool check_prologue_epilogue(block_t *block) {
+    if (!get_alloc(block)) {
+        dbg_printf("prologue/epilogue allocated \n");
+        return false;
+    }
+    if (get_size(block) != 0) {
+        dbg_printf("prologue/epilogue has positive size \n");
+        return false;
+    }
+    if ((size_t)block < (size_t)mem_heap_lo() || (size_t)block > (size_t)mem_heap_hi()) {
+        dbg_printf("prologue/epilogue out of bound \n");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Checks if the block is valid.
+ *
+ * @param[in] block The block to be checked
+ * @return True if the block is valid; False otherwise
+ */
+static bool check_block(block_t *block) {
+    word_t header = block->header;
+    size_t size = get_size(block);
+    bool alloc = get_alloc(block);
+    block_t *next_block = find_next(block);
+
+    // Check if the block is doubleword aligned
+    if (get_size(block) % dsize != 0) {
+        dbg_printf("%p is not doubleword aligned\n", (void*)block);
+        return false;
+    }
+
+    // Check if the block is at least the minimum block size
+    if (size < min_block_size) {
+        dbg_printf("%p is smaller than the minimum block size\n", (void*)block);
+        return false;
+    }
+
+    // Check if a free block has matched header and footer
+    if (!alloc && size > mini_block_size) {
+        word_t footer = *header_to_footer(block);
+        if (header != footer) {
+            dbg_printf("%p has unmatched header and footer\n", (void*)block);
+            return false;
+        }
+    }
+
+    // Check if the next block records this block's allocation status
+    if (get_prev_alloc(next_block) != alloc) {
+        dbg_printf("%p has a wrong prev_alloc bit in its next block\n", (void*)block);
+        return false;
+    }
+
+    // Check if the next block records whether this block is a mini block
+    if (get_prev_mini(next_block) != (size == mini_block_size)) {
+        dbg_printf("%p has a wrong prev_mini bit in its next block\n", (void*)block);
+        return false;
+    }
+
+    // Check no consecutive free blocks
+    if (!alloc){
+        if (!get_prev_alloc(block)) {
+            dbg_printf("%p has a consecitive free block before it\n", (void*)block);
+            return false;   
+        }
+        if (!get_alloc(next_block)) {
+            dbg_printf("%p has a consecitive free block after it\n", (void*)block);
+            return false;   
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Checks if the block is valid.
+ *
+ * @param[in] block The block to be checked
+ * @param[in] i index of the segregated list that the block belongs
+ * @return True if the block is valid; False otherwise
+ */
+static bool check_free_block(block_t *block, int i) {
+    bool alloc = get_alloc(block);
+    size_t block_size = get_size(block);
+    bool mini = (block_size == mini_block_size);
+    // Blocks of the tree have children instead, checked by check_tree
+    block_t *prev_block = (mini || i == tree_list) ? NULL : get_pred(block);
+    block_t *next_block = (i == tree_list) ? NULL : get_succ(block);
+
+    // Check if the block is free
+    if (alloc) {
+        dbg_printf("%p is allocated but in the free list\n", (void*)block);
+        return false;          
+    }
+
+    // Check if the free list pointer is inside the heap
+    if ((char *)block < (char *)mem_heap_lo() || (char *)block > (char *)mem_heap_hi()) {
+        dbg_printf("%p is outside the heap\n", (void*)block);
+        return false;           
+    }
+
+    // Check if next/previous pointers are consistent
+    if (prev_block != NULL && get_succ(prev_block) != block) {
+        dbg_printf("%p has inconsistent pred free blocks\n", (void*)block);
+        return false;           
+    }
+
+    if (!mini && next_block != NULL && get_pred(next_block) != block) {
+        dbg_printf("%p has inconsistent succ free blocks\n", (void*)block);
+        return false;          
+    }
+
+    // Check if the size is belong to the segregated list
+    if (find_index(block_size) != i) {
+        dbg_printf("%p belongs to the wrong segregated list\n", (void*)block);
+        return false;          
+    }
+
+    return true;
+}
+
+/**
+ * @brief Checks if a slab run is valid.
+ *
+ * @param[in] run The run to be checked
+ * @return True if the run is valid; False otherwise
+ */
+static bool check_run(run_t *run) {
+    // Check if the run has a valid size class
+    if (run->size_class >= (uint32_t)slab_class_count) {
+        dbg_printf("run %p has an invalid size class\n", (void*)run);
+        return false;
+    }
+
+    // Check if the free slot count matches the bitmap
+    uint32_t nfree = 0;
+    for (int w = 0; w < 4; w++) {
+        nfree += (uint32_t)__builtin_popcountl(run->free_map[w]);
+    }
+    if (nfree != run->nfree || nfree > run_nslots((int)run->size_class)) {
+        dbg_printf("run %p has an inconsistent free slot count\n", (void*)run);
+        return false;
+    }
+
+    // Check if the run's pages are marked in the page map
+    if (!is_run_payload(run)) {
+        dbg_printf("run %p is not in the run page map\n", (void*)run);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Checks the blocks of a heap, from its first block to its epilogue.
+ *
+ * @param[in] prologue The prologue, right before the first block
+ * @param[in] epilogue The epilogue
+ * @param[in] line The line number
+ * @return True if the blocks are valid; False otherwise
+ */
+static bool check_heap_blocks(block_t *prologue, block_t *epilogue, int line) {
+    block_t *first = (block_t *)((word_t *)prologue + 1);
+
+    /* check prologue/epilogue */
+    if (!check_prologue_epilogue(prologue)) {
+        dbg_printf("prologue error\n");
+        return false;
+    }
+    if (!check_prologue_epilogue(epilogue)) {
+        dbg_printf("epilogue error\n");
+        return false;
+    }
+
+    /* the first block follows the prologue */
+    if (!get_prev_alloc(first)) {
+        dbg_printf("first block does not follow an allocated prologue\n");
+        return false;
+    }
+
+    /* check block */
+    block_t *start = first;
+    while (get_size(start) != 0) {
+        if (!check_block(start)) {
+            dbg_printf("Invalid block (called at line %d)\n", line);
+            return false;
+        }
+        if (get_alloc(start) && is_run_payload(header_to_payload(start)) &&
+            !check_run((run_t *)header_to_payload(start))) {
+            dbg_printf("Invalid run (called at line %d)\n", line);
+            return false;
+        }
+        start = find_next(start);
+    }
+    if (start != epilogue) {
+        dbg_printf("blocks end at %p, not at the epilogue\n", (void *)start);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Checks a subtree of the tree of large blocks of an arena.
+ *
+ * @param[in] ar The arena
+ * @param[in] node The root of the subtree, or NULL
+ * @param[in] lo The block every block of the subtree comes after, or NULL
+ * @param[in] hi The block every block of the subtree comes before, or NULL
+ * @return True if the subtree is ordered and balanced, and only holds free
+ *         blocks of the arena
+ */
+static bool check_tree(arena_t *ar, block_t *node, block_t *lo, block_t *hi) {
+    if (node == NULL) {
+        return true;
+    }
+    if (!check_free_block(node, tree_list) ||
+        payload_arena(header_to_payload(node)) != ar) {
+        dbg_printf("%p is not a free block of the arena\n", (void*)node);
+        return false;
+    }
+    if ((lo != NULL && !tree_before(lo, node)) ||
+        (hi != NULL && !tree_before(node, hi))) {
+        dbg_printf("%p is out of order in the tree\n", (void*)node);
+        return false;
+    }
+
+    size_t left = tree_height(get_left(node));
+    size_t right = tree_height(get_right(node));
+    if (node->height != max(left, right) + 1 || left > right + 1 ||
+        right > left + 1) {
+        dbg_printf("%p has a wrong height or is unbalanced\n", (void*)node);
+        return false;
+    }
+    return check_tree(ar, get_left(node), lo, node) &&
+           check_tree(ar, get_right(node), node, hi);
+}
+
+/**
+ * @brief Checks if the free lists and slab runs of an arena are valid.
+ *
+ * @param[in] ar The arena
+ * @param[in] line The line number
+ * @return True if the arena is valid; False otherwise
+ */
+static bool check_arena(arena_t *ar, int line) {
+    // Check slab run lists
+    for (int c = 0; c < slab_class_count; c++) {
+        for (run_t *run = ar->slab_runs[c]; run != NULL; run = run->next) {
+            if (run->size_class != (uint32_t)c || run->nfree == 0 ||
+                (run->next != NULL && run->next->prev != run) ||
+                payload_arena(run) != ar) {
+                dbg_printf("Invalid run list %d (called at line %d)\n", c, line);
+                return false;
+            }
+        }
+    }
+
+    // Check quick lists
+    for (size_t q = 0; q <= quick_max / dsize; q++) {
+        uint32_t count = 0;
+        for (block_t *block = ar->quick_lists[q]; block != NULL;
+             block = get_succ(block)) {
+            if (!get_alloc(block) || get_size(block) != (q + 1) * dsize ||
+                payload_arena(header_to_payload(block)) != ar) {
+                dbg_printf("Invalid quick list %zu (called at line %d)\n", q,
+                           line);
+                return false;
+            }
+            count++;
+        }
+        if (count != ar->quick_counts[q]) {
+            dbg_printf("quick list %zu has an inconsistent count\n", q);
+            return false;
+        }
+    }
+
+    // Check the wilderness
+    block_t *top = ar->top;
+    if (top != NULL &&
+        (get_alloc(top) || get_size(find_next(top)) != 0 ||
+         payload_arena(header_to_payload(top)) != ar)) {
+        dbg_printf("Invalid wilderness (called at line %d)\n", line);
+        return false;
+    }
+
+    // Check free list
+    block_t *free_block;
+
+    for (int i = 0; i < list_length; i++) {
+        // Check if the occupancy bitmaps match the list
+        int fl = i >> sl_log2;
+        int sl = i & ((1 << sl_log2) - 1);
+        if (((ar->sl_bitmap[fl] >> sl) & 1) != (ar->segregated_list[i] != NULL) ||
+            ((ar->fl_bitmap >> fl) & 1) != (ar->sl_bitmap[fl] != 0)) {
+            dbg_printf("segregated list %d disagrees with the bitmap\n", i);
+            return false;
+        }
+
+        if (i == tree_list) {
+            if (!check_tree(ar, ar->segregated_list[i], NULL, NULL)) {
+                dbg_printf("Invalid free tree (called at line %d)\n", line);
+                return false;
+            }
+            continue;
+        }
+
+        for (free_block = ar->segregated_list[i]; free_block != NULL; free_block = get_succ(free_block)) {
+            if (!check_free_block(free_block, i)) {
+                dbg_printf("Invalid free block (called at line %d)\n", line);
+                return false;   
+            }         
+            if (payload_arena(header_to_payload(free_block)) != ar) {
+                dbg_printf("%p is in the free list of another arena\n", (void*)free_block);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Checks if the heap is valid.
+ *
+ * The arenas are not locked, so no other thread may use the allocator.
+ *
+ * @param[in] line The line number
+ * @return True if the heap is valid; False otherwise
+ */
+bool mm_checkheap(int line) {
+    block_t *prologue = (block_t *)((word_t *)heap_start - 1);
+    if (!check_heap_blocks(prologue, heap_end, line)) {
+        return false;
+    }
+
+    // Check the arena heaps of the other arenas
+    size_t heap_count = mem_heapsize() / arena_heap_size;
+    for (size_t h = 0; h < heap_count && h < arena_heap_count; h++) {
+        if (arena_heap_owner[h] != 0) {
+            char *base = (char *)mem_heap_lo() + h * arena_heap_size;
+            if (!check_heap_blocks((block_t *)(base + dsize - 2 * wsize),
+                                   (block_t *)(base + arena_heap_size - wsize),
+                                   line)) {
+                dbg_printf("Invalid arena heap %zu\n", h);
+                return false;
+            }
+        }
+    }
+
+    for (int a = 0; a < arena_count; a++) {
+        if (!check_arena(&arenas[a], line)) {
+            dbg_printf("Invalid arena %d\n", a);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void print_heap() {
+    block_t *prologue = (block_t *)((word_t *)heap_start - 1);
+    block_t *epilogue = heap_end;
+    dbg_printf("prologue at %p\n", (void *)prologue);
+
+    block_t *start = heap_start;
+    while (start != NULL && get_size(start) != 0) {
+        dbg_printf("block at %p, size is %zu, payload is %zu, %d\n", (void *)start, get_size(start), get_payload_size(start), get_alloc(start));
+        start = find_next(start);
+    }
+
+    dbg_printf("epilogue at %p\n\n", (void *)epilogue);
+}
+
+/**
+ * @brief Acquires the lock of an arena, and makes it the current arena.
+ *
+ * @param[in] a The arena
+ */
+static void lock_arena(arena_t *a) {
+#if MM_THREADS
+    if (pthread_mutex_trylock(&a->lock) != 0) {
+        __atomic_fetch_add(&a->lock_contended, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&a->lock);
+    }
+#endif
+    a->lock_acquired++;
+    arena = a;
+}
+
+/**
+ * @brief Releases the lock of the current arena.
+ */
+static void unlock_arena(void) {
+#if MM_THREADS
+    pthread_mutex_unlock(&arena->lock);
+#endif
+}
+
+/**
+ * @brief Acquires the lock of this thread's arena, and makes it the current
+ *        arena.
+ *
+ * A thread is assigned an arena round-robin on first use. When the lock of
+ * its arena is held by another thread, it moves to the next arena whose
+ * lock is free, and only waits if there is none.
+ */
+static void lock_home_arena(void) {
+    if (home_arena == NULL) {
+        unsigned int n =
+            __atomic_fetch_add(&arenas_assigned, 1, __ATOMIC_RELAXED);
+        home_arena = &arenas[n % (unsigned int)arena_count];
+    }
+
+#if MM_THREADS
+    if (pthread_mutex_trylock(&home_arena->lock) != 0) {
+        __atomic_fetch_add(&home_arena->lock_contended, 1, __ATOMIC_RELAXED);
+        arena_t *free_arena = NULL;
+        for (int i = 1; i < arena_count && free_arena == NULL; i++) {
+            arena_t *a = &arenas[(home_arena - arenas + i) % arena_count];
+            if (pthread_mutex_trylock(&a->lock) == 0) {
+                free_arena = a;
+            }
+        }
+        if (free_arena != NULL) {
+            home_arena = free_arena;
+        } else {
+            pthread_mutex_lock(&home_arena->lock);
+        }
+    }
+#endif
+    home_arena->lock_acquired++;
+    arena = home_arena;
+}
+
+/**
+ * @brief Initializes the heap structure.
+ *
+ * @return true if successful, false otherwise
+ * @pre The lock of arena 0 is held, and it is the current arena.
+ * @post The initialized heap is valid and empty. Heap_start points to the first block.
+ */
+static bool init_heap(void) {
+    // Create the initial empty heap, with the epilogue a word before the
+    // first aligned payload
+    __atomic_store_n(&heap_ready, false, __ATOMIC_RELAXED);
+    heap_base = mem_heap_lo();
+    char *base = mem_sbrk(dsize);
+
+    if (base == (void *)-1) {
         return false;
     }
-    if (get_size(block) != 0) {
-        dbg_printf("prologue/epilogue has positive size \n");
-        return false;
+    word_t *start = (word_t *)(base + dsize - 2 * wsize);
+
+    start[0] = pack(0, true, false, true); // Heap prologue (block footer)
+    start[1] = pack(0, true, false, true); // Heap epilogue (block header)
+
+    // Heap starts with first "block header", currently the epilogue
+    heap_start = (block_t *)&(start[1]);
+    heap_end = heap_start;
+    growth_step = chunksize;
+
+    for (int a = 0; a < arena_count; a++) {
+        arena_t *ar = &arenas[a];
+
+        // Initialize segregated list
+        for (int i = 0; i < list_length; i++) {
+            ar->segregated_list[i] = NULL;
+        }
+        for (int fl = 0; fl < fl_count; fl++) {
+            ar->sl_bitmap[fl] = 0;
+        }
+        ar->fl_bitmap = 0;
+        ar->top = NULL;
+        ar->stats = (mm_stats_t){0};
+        ar->remote_frees = NULL;
+        ar->remote_bytes = 0;
+        ar->zero_start = NULL; // Set as soon as the arena has memory
+
+        // Initialize slab runs and quick lists
+        for (int c = 0; c < slab_class_count; c++) {
+            ar->slab_runs[c] = NULL;
+        }
+        for (size_t q = 0; q <= quick_max / dsize; q++) {
+            ar->quick_lists[q] = NULL;
+            ar->quick_counts[q] = 0;
+        }
     }
-    if ((size_t)block < (size_t)mem_heap_lo() || (size_t)block > (size_t)mem_heap_hi()) {
-        dbg_printf("prologue/epilogue out of bound \n");
+    for (size_t h = 0; h < arena_heap_count; h++) {
+        arena_heap_owner[h] = 0;
+    }
+    for (size_t w = 0; w < sizeof(run_page_map) / sizeof(run_page_map[0]);
+         w++) {
+        run_page_map[w] = 0;
+    }
+
+    // Drop every thread's cache of the old heap
+    heap_generation++;
+    map_threshold = map_threshold_min;
+
+    // Extend the empty heap with a free block of chunksize bytes
+    if (extend_heap(chunksize) == NULL) {
         return false;
     }
 
+    // print_heap();
+    dbg_ensures(mm_checkheap(__LINE__));
+
+    // Publish the heap to the threads that skip the lock in ensure_heap
+    __atomic_store_n(&heap_ready, true, __ATOMIC_RELEASE);
     return true;
 }
 
 /**
- * @brief Checks if the block is valid.
+ * @brief Initializes the heap structure.
  *
- * @param[in] block The block to be checked
- * @return True if the block is valid; False otherwise
+ * No other thread may use the allocator while the heap is initialized.
+ *
+ * @return true if successful, false otherwise
+ * @post The initialized heap is valid and empty. Heap_start points to the first block.
  */
-static bool check_block(block_t *block) {
-    word_t header = block->header;
-    word_t footer = *header_to_footer(block);
-    size_t size = get_size(block);
-    bool alloc = get_alloc(block);
-    block_t *prev_block = find_prev(block);
-    block_t *next_block = find_next(block);
-
-    // Check if the block is doubleword aligned
-    if (get_size(block) % dsize != 0) {
-        dbg_printf("%p is not doubleword aligned\n", (void*)block);
-        return false;
+bool mm_init(void) {
+    // The lock counters are reset here rather than in init_heap, where
+    // threads racing on the first allocation already contend for arena 0
+    for (int a = 0; a < arena_count; a++) {
+        arenas[a].lock_acquired = 0;
+        __atomic_store_n(&arenas[a].lock_contended, 0, __ATOMIC_RELAXED);
     }
+    lock_arena(&arenas[0]);
+    bool ok = init_heap();
+    unlock_arena();
+    return ok;
+}
 
-    // Check if the block has matched header and footer
-    if (header != footer) {
-        dbg_printf("%p has unmatched header and footer\n", (void*)block);
-        return false;        
+/**
+ * @brief Initializes the heap on first use.
+ *
+ * Threads racing on the first allocation all see the heap unset. The flag is
+ * checked again under the lock of arena 0, so only one of them initializes it.
+ *
+ * @return true if the heap is initialized, false otherwise
+ */
+static bool ensure_heap(void) {
+    if (__atomic_load_n(&heap_ready, __ATOMIC_ACQUIRE)) {
+        return true;
     }
 
-    // Check if the block stores consistent sizes
-    if (extract_size(header) != size || extract_size(footer) != size) {
-        dbg_printf("%p stores unconsistent sizes\n", (void*)block);
-        return false;          
+    lock_arena(&arenas[0]);
+    bool ok = __atomic_load_n(&heap_ready, __ATOMIC_RELAXED) || init_heap();
+    unlock_arena();
+    return ok;
+}
+
+/**
+ * @brief Reports counters describing the work done since mm_init.
+ *
+ * Counters are summed over the arenas, except for the lock counters, which
+ * are reported per arena.
+ *
+ * @param[out] out The structure the counters are copied into
+ */
+void mm_get_stats(mm_stats_t *out) {
+    *out = (mm_stats_t){0};
+    out->arena_count = (size_t)arena_count;
+    for (int a = 0; a < arena_count; a++) {
+        arena_t *ar = &arenas[a];
+        out->fit_searches += ar->stats.fit_searches;
+        out->fit_scanned += ar->stats.fit_scanned;
+        out->remote_frees += ar->stats.remote_frees;
+        out->trimmed_bytes += ar->stats.trimmed_bytes;
+        out->purged_bytes += ar->stats.purged_bytes;
+        out->extensions += ar->stats.extensions;
+        out->quick_hits += ar->stats.quick_hits;
+        out->quick_flushes += ar->stats.quick_flushes;
+        out->top_hits += ar->stats.top_hits;
+        out->lock_acquired[a] = ar->lock_acquired;
+        out->lock_contended[a] =
+            __atomic_load_n(&ar->lock_contended, __ATOMIC_RELAXED);
     }
+}
 
-    // Check if the block stores consistent allocation status
-    if (extract_alloc(header) != alloc || extract_alloc(footer) != alloc) {
-        dbg_printf("%p stores unconsistent allocation status\n", (void*)block);
-        return false;          
+/**
+ * @brief Allocate an uninitialized block of requested size
+ *
+ * @param[in] size The requested size to be allocated
+ * @return a pointer to the allocated block of at least size bytes
+ * @pre size > 0. The heap is initialized, and the current arena is locked.
+ * @post The heap after the allocation is still valid
+ */
+static void *malloc_locked(size_t size) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    size_t asize; // Adjusted block size
+    block_t *block;
+    void *bp = NULL;
+
+    // Ignore spurious and impossibly large requests
+    if (size == 0 || size > SIZE_MAX / 2) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
     }
 
-    // Check no consecutive free blocks
-    if (!alloc){
-        if (prev_block != NULL && !get_alloc(prev_block)) {
-            dbg_printf("%p has a consecitive free block before it\n", (void*)block);
-            return false;   
+    // Small requests are served from slab runs when possible
+    if (size <= slab_max) {
+        bp = slab_malloc(size);
+        if (bp != NULL) {
+            dbg_ensures(mm_checkheap(__LINE__));
+            return bp;
         }
-        if (next_block != NULL && !get_alloc(next_block)) {
-            dbg_printf("%p has a consecitive free block after it\n", (void*)block);
-            return false;   
+    }
+
+    // Adjust block size to include the header and to meet alignment
+    // requirements; allocated blocks have no footer, and requests of up to
+    // one word fit in a mini block
+    asize = max(round_up(size + wsize, dsize), min_block_size);
+
+    if (huge_threshold != 0 && asize >= huge_page_size) {
+        block = malloc_aligned_block(asize, huge_page_size);
+    } else {
+        block = quick_pop(asize);
+        if (block == NULL) {
+            block = malloc_block(asize);
         }
     }
+    if (block == NULL) {
+        return bp;
+    }
 
-    return true;
+    bp = header_to_payload(block);
+
+    // print_heap();
+    dbg_ensures(mm_checkheap(__LINE__));
+    return bp;
 }
 
 /**
- * @brief Checks if the block is valid.
+ * @brief Frees an allocated block
  *
- * @param[in] block The block to be checked
- * @param[in] i index of the segregated list that the block belongs
- * @return True if the block is valid; False otherwise
+ * @param[in] bp a pointer to the block payload
+ * @param[in] asize the size of the block, or 0 to read it from its header
+ * @return void
+ * @pre bp points to the beginning of a block payload, of a block of the
+ *      current arena, which is locked.
+ * @post the corresponding block is freed
  */
-static bool check_free_block(block_t *block, int i) {
-    bool alloc = get_alloc(block);
-    size_t block_size = get_size(block);
-    block_t *prev_block = block->pred;
-    block_t *next_block = block->succ;
+static void free_locked(void *bp, size_t asize) {
+    dbg_requires(mm_checkheap(__LINE__));
 
-    // Check if the block is free
-    if (alloc) {
-        dbg_printf("%p is allocated but in the free list\n", (void*)block);
-        return false;          
+    if (is_run_payload(bp)) {
+        slab_free(bp);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
     }
 
-    // Check if the free list pointer is inside the heap
-    if ((char *)block < (char *)mem_heap_lo() || (char *)block > (char *)mem_heap_hi()) {
-        dbg_printf("%p is outside the heap\n", (void*)block);
-        return false;           
+    if (asize == 0) {
+        asize = get_size(payload_to_header(bp));
     }
-
-    // Check if next/previous pointers are consistent
-    if (prev_block != NULL && prev_block->succ != block) {
-        dbg_printf("%p has inconsistent pred free blocks\n", (void*)block);
-        return false;           
+    if (!quick_push(payload_to_header(bp), asize)) {
+        // Once a large free block forms, coalesce the quick lists too, as
+        // they may keep it from reaching the top of the heap
+        if (free_block(payload_to_header(bp)) >= quick_flush_size) {
+            quick_flush();
+        }
     }
 
-    if (next_block != NULL && next_block->pred != block) {
-        dbg_printf("%p has inconsistent succ free blocks\n", (void*)block);
-        return false;          
-    }
+    // print_heap();
+    dbg_ensures(mm_checkheap(__LINE__));
+}
 
-    // Check if the size is belong to the segregated list
-    if (find_index(block_size) != i) {
-        dbg_printf("%p belongs to the wrong segregated list\n", (void*)block);
-        return false;          
+/**
+ * @brief Frees the blocks other threads queued for the current arena.
+ *
+ * @pre The current arena is locked.
+ */
+static void drain_remote_frees(void) {
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL) {
+        return;
     }
 
-    return true;
+    void *bp = __atomic_exchange_n(&arena->remote_frees, NULL,
+                                   __ATOMIC_ACQUIRE);
+    while (bp != NULL) {
+        void *next = *(void **)bp;
+        __atomic_fetch_sub(&arena->remote_bytes, get_usable_size(bp),
+                           __ATOMIC_RELAXED);
+        free_locked(bp, 0);
+        arena->stats.remote_frees++;
+        bp = next;
+    }
 }
 
 /**
- * @brief Checks if the heap is valid.
+ * @brief Returns whether a block being freed is queued for its arena.
  *
- * @param[in] line The line number
- * @return True if the heap is valid; False otherwise
+ * A thread that never allocated has no arena, and frees every block under
+ * the lock of its owner instead, so that nothing waits in a queue that only
+ * the owner's next allocation would drain.
+ *
+ * @param[in] owner The arena owning the block
+ * @return True if the block belongs to an arena other than this thread's
  */
-bool mm_checkheap(int line) {
-    block_t *prologue = (block_t *)((word_t *)heap_start - 1);
-    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+static bool is_remote(arena_t *owner) {
+    return home_arena != NULL && owner != home_arena;
+}
 
-    /* check prologue/epilogue */
-    if (!check_prologue_epilogue(prologue)) {
-        dbg_printf("prologue error\n");
-        return false;
+/**
+ * @brief Queues a block for the arena owning it, without taking its lock.
+ *
+ * Once remote_free_limit bytes are queued, the queue is drained right away
+ * if the arena's lock is free. It is never waited for, so this may be called
+ * with another arena locked.
+ *
+ * @param[in] owner The arena owning the block
+ * @param[in] bp A pointer to the block payload
+ */
+static void remote_free(arena_t *owner, void *bp) {
+    size_t size = get_usable_size(bp);
+    void *head = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+    do {
+        *(void **)bp = head;
+    } while (!__atomic_compare_exchange_n(&owner->remote_frees, &head, bp,
+                                          true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+
+    if (__atomic_add_fetch(&owner->remote_bytes, size, __ATOMIC_RELAXED) <
+        remote_free_limit) {
+        return;
     }
-    if (!check_prologue_epilogue(epilogue)) {
-        dbg_printf("epilogue error\n");
-        return false;
+#if MM_THREADS
+    if (pthread_mutex_trylock(&owner->lock) == 0) {
+        arena_t *current = arena;
+        owner->lock_acquired++;
+        arena = owner;
+        drain_remote_frees();
+        unlock_arena();
+        arena = current;
     }
+#endif
+}
 
-    /* check block */
-    block_t *start = heap_start;
-    while (start != NULL && get_size(start) != 0) {
-        if (!check_block(start)) {
-            dbg_printf("Invalid block (called at line %d)\n", line);
-            return false;
-        }
-        start = find_next(start);
-    }
+/**
+ * @brief Finds the cache bin holding blocks with the given usable size.
+ *
+ * @param[in] usable The usable size of a block
+ * @return The bin index, or -1 if blocks of that size are not cached
+ */
+static int tcache_bin(size_t usable) {
+    size_t i = usable / wsize - 1;
+    return (i < (size_t)tcache_bin_count) ? (int)i : -1;
+}
 
-    // Check free list
-    block_t *free_block;
+/**
+ * @brief Returns the usable size malloc normally gives a request.
+ *
+ * @param[in] size The requested size
+ * @return The usable size of the block malloc would return
+ * @pre size > 0
+ */
+static size_t request_usable_size(size_t size) {
+    if (size <= slab_max) {
+        return slab_sizes[slab_class(size)];
+    }
+    return max(round_up(size + wsize, dsize), min_block_size) - wsize;
+}
 
-    for (int i = 0; i < list_length; i++) {
-        for (free_block = segregated_list[i]; free_block != NULL; free_block = free_block->succ) {
-            if (!check_free_block(free_block, i)) {
-                dbg_printf("Invalid free block (called at line %d)\n", line);
-                return false;   
-            }         
+/**
+ * @brief Drops this thread's cache if it was filled from an older heap.
+ */
+static void tcache_check_generation(void) {
+    if (tcache.generation != heap_generation) {
+        for (int i = 0; i < tcache_bin_count; i++) {
+            tcache.bins[i] = NULL;
+            tcache.counts[i] = 0;
         }
+        tcache.generation = heap_generation;
     }
+}
 
-    return true;
+/**
+ * @brief Pops a payload off a cache bin.
+ *
+ * @param[in] i The bin index
+ * @return The payload
+ * @pre The bin is non-empty
+ */
+static void *tcache_pop(int i) {
+    void *bp = tcache.bins[i];
+    tcache.bins[i] = *(void **)bp;
+    tcache.counts[i]--;
+    return bp;
 }
 
-static void print_heap() {
-    block_t *prologue = (block_t *)((word_t *)heap_start - 1);
-    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
-    dbg_printf("prologue at %p\n", (void *)prologue);
+/**
+ * @brief Pushes a payload onto a cache bin.
+ *
+ * @param[in] i The bin index
+ * @param[in] bp The payload
+ */
+static void tcache_push(int i, void *bp) {
+    *(void **)bp = tcache.bins[i];
+    tcache.bins[i] = bp;
+    tcache.counts[i]++;
+}
 
-    block_t *start = heap_start;
-    while (start != NULL && get_size(start) != 0) {
-        dbg_printf("block at %p, size is %zu, payload is %zu, %d\n", (void *)start, get_size(start), get_payload_size(start), get_alloc(start));
-        start = find_next(start);
+/**
+ * @brief Frees up to n blocks of a cache bin back to their arenas.
+ *
+ * Blocks of other arenas than this thread's are queued for them. The lock
+ * of this thread's arena is taken once, for the first of its blocks. A
+ * thread without an arena switches locks whenever the owner changes.
+ *
+ * @param[in] i The bin index
+ * @param[in] n The number of blocks to free
+ */
+static void tcache_flush(int i, uint32_t n) {
+    arena_t *locked = NULL;
+    while (n-- > 0 && tcache.counts[i] > 0) {
+        void *bp = tcache_pop(i);
+        arena_t *owner = payload_arena(bp);
+        if (is_remote(owner)) {
+            remote_free(owner, bp);
+            continue;
+        }
+        if (locked != owner) {
+            if (locked != NULL) {
+                unlock_arena();
+            }
+            lock_arena(owner);
+            locked = owner;
+        }
+        free_locked(bp, 0);
+    }
+    if (locked != NULL) {
+        unlock_arena();
     }
-
-    dbg_printf("epilogue at %p\n\n", (void *)epilogue);
 }
 
+#if MM_THREADS
 /**
- * @brief Initializes the heap structure.
+ * @brief Frees every block of an exiting thread's cache back to the heap.
  *
- * @return true if successful, false otherwise
- * @post The initialized heap is valid and empty. Heap_start points to the first block.
+ * @param[in] arg Unused
  */
-bool mm_init(void) {
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
-
-    if (start == (void *)-1) {
-        return false;
+static void tcache_destroy(void *arg) {
+    (void)arg;
+    if (tcache.generation == heap_generation) {
+        for (int i = 0; i < tcache_bin_count; i++) {
+            tcache_flush(i, tcache.counts[i]);
+        }
     }
+}
 
-    start[0] = pack(0, true); // Heap prologue (block footer)
-    start[1] = pack(0, true); // Heap epilogue (block header)
+/**
+ * @brief Creates the key used to flush thread caches on thread exit.
+ */
+static void tcache_create_key(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+#endif
 
-    // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *)&(start[1]);
+/**
+ * @brief Takes a block for a request from this thread's cache, refilling
+ *        the bin with a batch of blocks from its arena if it is empty.
+ *
+ * @param[in] size The requested size
+ * @return A payload of at least size bytes, or NULL if requests of this size
+ *         are not cached or the heap is out of memory
+ * @pre size > 0
+ */
+static void *tcache_malloc(size_t size) {
+    int i = tcache_bin(request_usable_size(size));
+    if (i < 0) {
+        return NULL;
+    }
 
-    // Initialize segregated list
-    for (int i = 0; i < list_length; i++) {
-        segregated_list[i] = NULL;
+    tcache_check_generation();
+    if (tcache.counts[i] > 0) {
+        return tcache_pop(i);
     }
 
-    // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL) {
+    lock_home_arena();
+    drain_remote_frees();
+    void *bp = malloc_locked(size);
+    for (uint32_t n = 1; bp != NULL && n < tcache_batch; n++) {
+        void *extra = malloc_locked(size);
+        if (extra == NULL) {
+            break;
+        }
+        // A fallback block of another size does not belong in this bin
+        if (tcache_bin(get_usable_size(extra)) != i) {
+            free_locked(extra, 0);
+            break;
+        }
+        tcache_push(i, extra);
+    }
+    unlock_arena();
+    return bp;
+}
+
+/**
+ * @brief Puts a freed block into this thread's cache, first freeing a batch
+ *        of the bin's blocks back to their arenas if the bin is full.
+ *
+ * @param[in] bp A pointer to the block payload
+ * @param[in] usable The usable size of the block
+ * @return true if the block was cached, false if blocks of its size are not
+ */
+static bool tcache_free(void *bp, size_t usable) {
+    int i = tcache_bin(usable);
+    if (i < 0) {
         return false;
     }
 
-    // print_heap();
-    dbg_ensures(mm_checkheap(__LINE__));
+    tcache_check_generation();
+#if MM_THREADS
+    if (!tcache.registered) {
+        pthread_once(&tcache_key_once, tcache_create_key);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = true;
+    }
+#endif
+
+    if (tcache.counts[i] == tcache_bin_max) {
+        tcache_flush(i, tcache_batch);
+    }
+    tcache_push(i, bp);
     return true;
 }
 
 /**
  * @brief Allocate an uninitialized block of requested size
  *
+ * Requests of at least map_threshold bytes get a region of their own. In
+ * thread-safe builds, small requests are served from the calling thread's
+ * cache without taking any lock, and the others from the thread's arena.
+ *
  * @param[in] size The requested size to be allocated
  * @return a pointer to the allocated block of at least size bytes
  * @pre size > 0
  * @post The heap after the allocation is still valid
  */
-void *malloc(size_t size) {
-    dbg_requires(mm_checkheap(__LINE__));
-
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
-    block_t *block;
-    void *bp = NULL;
+void *malloc(size_t size) {
+    void *bp;
 
     // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        if (!(mm_init())) {
-            dbg_printf("Problem initializing heap. Likely due to sbrk");
-            return NULL;
-        }
+    if (!ensure_heap()) {
+        dbg_printf("Problem initializing heap. Likely due to sbrk");
+        return NULL;
     }
-    dbg_assert(mm_checkheap(__LINE__));
 
-    // Ignore spurious request
-    if (size == 0) {
-        dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
+    // Impossibly large requests would wrap the size of the block
+    if (size > SIZE_MAX / 2) {
+        return NULL;
     }
 
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + dsize, dsize);
-
-    // Search the free list for a fit
-    block = find_fit(asize);
-
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        // extend_heap returns an error
-        if (block == NULL) {
+    if (map_threshold_min != 0 &&
+        size >= __atomic_load_n(&map_threshold, __ATOMIC_RELAXED)) {
+        bp = map_block(size);
+        if (bp != NULL) {
             return bp;
         }
     }
 
-    // The block should be marked as free
-    dbg_assert(!get_alloc(block));
-
-    // Mark block as allocated
-    size_t block_size = get_size(block);
-    write_block(block, block_size, true);
-    // ??
-    remove_from_free_list(block);
-
-    // Try to split the block if too large
-    split_block(block, asize);
-
-    bp = header_to_payload(block);
+    if (MM_THREADS && size != 0) {
+        bp = tcache_malloc(size);
+        if (bp != NULL) {
+            return bp;
+        }
+    }
 
-    // print_heap();
-    dbg_ensures(mm_checkheap(__LINE__));
+    lock_home_arena();
+    drain_remote_frees();
+    bp = malloc_locked(size);
+    unlock_arena();
+
+    // Blocks too large for an arena heap come from arena 0
+    if (bp == NULL && size != 0 && arena != &arenas[0]) {
+        lock_arena(&arenas[0]);
+        drain_remote_frees();
+        bp = malloc_locked(size);
+        unlock_arena();
+    }
     return bp;
 }
 
 /**
  * @brief Frees an allocated block
  *
+ * Blocks with a region of their own are unmapped. In thread-safe builds,
+ * small blocks go to the calling thread's cache without taking any lock, and
+ * the others to the arena owning them, through its remote-free queue if that
+ * is not the calling thread's arena.
+ *
  * @param[in] bp a pointer to the block payload
  * @return void
  * @pre bp is NULL or points to the beginning of a block payload
  * @post the corresponding block is freed
  */
 void free(void *bp) {
-    dbg_requires(mm_checkheap(__LINE__));
+    if (bp == NULL) {
+        return;
+    }
+
+    if (is_mapped_payload(bp)) {
+        unmap_block(bp);
+        return;
+    }
+
+    // The header is read without the lock: other threads may change its
+    // prev bits, but never the size of a block they do not own, and both
+    // sides access it atomically
+    if (MM_THREADS && tcache_free(bp, get_usable_size(bp))) {
+        return;
+    }
+
+    // Blocks of another arena than this thread's are queued for it
+    arena_t *owner = payload_arena(bp);
+    if (MM_THREADS && is_remote(owner)) {
+        remote_free(owner, bp);
+        return;
+    }
+
+    lock_arena(owner);
+    free_locked(bp, 0);
+    unlock_arena();
+}
 
+/**
+ * @brief Frees an allocated block of a known size
+ *
+ * The size tells which thread cache bin or quick list the block goes to,
+ * so unless the block may have a region of its own, its header is only
+ * read if it has to be coalesced.
+ *
+ * @param[in] bp a pointer to the block payload
+ * @param[in] size the size bp was allocated with, or its usable size
+ * @return void
+ * @pre bp is NULL or points to the beginning of a block payload
+ * @post the corresponding block is freed
+ */
+void free_sized(void *bp, size_t size) {
     if (bp == NULL) {
         return;
     }
 
-    block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
+    // Smaller blocks never get a region of their own
+    if (map_threshold_min != 0 && size >= map_threshold_min &&
+        is_mapped_payload(bp)) {
+        unmap_block(bp);
+        return;
+    }
 
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
+    // Slab slots keep their size class when realloc shrinks them. Without
+    // mini blocks, a block may also keep a remainder too small to split off.
+    size_t usable = (is_run_payload(bp) || min_block_size != mini_block_size)
+                        ? get_usable_size(bp)
+                        : max(round_up(size + wsize, dsize), min_block_size) -
+                              wsize;
+    dbg_requires(usable == get_usable_size(bp));
 
-    // Mark the block as free
-    write_block(block, size, false);
+    if (MM_THREADS && tcache_free(bp, usable)) {
+        return;
+    }
 
-    // Try to coalesce the block with its neighbors
-    block = coalesce_block(block);
-    insert_to_free_list(block);
+    // Blocks of another arena than this thread's are queued for it
+    arena_t *owner = payload_arena(bp);
+    if (MM_THREADS && is_remote(owner)) {
+        remote_free(owner, bp);
+        return;
+    }
 
-    // print_heap();
-    dbg_ensures(mm_checkheap(__LINE__));
+    lock_arena(owner);
+    free_locked(bp, usable + wsize);
+    unlock_arena();
+}
+
+/**
+ * @brief Returns the number of bytes that can be used at an allocated block
+ *
+ * @param[in] bp a pointer to the block payload, or NULL
+ * @return the size of the payload, at least the size bp was allocated with,
+ *         or 0 if bp is NULL
+ */
+size_t malloc_usable_size(void *bp) {
+    return (bp == NULL) ? 0 : get_usable_size(bp);
 }
 
 /**
@@ -943,12 +3886,11 @@ void free(void *bp) {
  *
  * @param[in] ptr a pointer to the block payload
  * @param[in] size the new size to be allocated
- * @return the new block
+ * @return the new block, which is ptr if it was resized in place
  * @pre size >= 0
- * @post ptr is freed
+ * @post ptr is freed, unless it is returned
  */
 void *realloc(void *ptr, size_t size) {
-    block_t *block = payload_to_header(ptr);
     size_t copysize;
     void *newptr;
 
@@ -958,12 +3900,39 @@ void *realloc(void *ptr, size_t size) {
         return NULL;
     }
 
+    // Impossibly large requests fail, leaving the block untouched
+    if (size > SIZE_MAX / 2) {
+        return NULL;
+    }
+
     // If ptr is NULL, then equivalent to malloc
     if (ptr == NULL) {
         return malloc(size);
     }
 
-    // Otherwise, proceed with reallocation
+    // Slab slots are kept if they are large enough, mapped blocks if the
+    // request would still be mapped, and regular blocks are resized in place
+    // if possible
+    if (is_run_payload(ptr)) {
+        if (size <= get_usable_size(ptr)) {
+            return ptr;
+        }
+    } else if (is_mapped_payload(ptr)) {
+        if (size <= get_usable_size(ptr) &&
+            size >= __atomic_load_n(&map_threshold, __ATOMIC_RELAXED)) {
+            return ptr;
+        }
+    } else {
+        size_t asize = max(round_up(size + wsize, dsize), min_block_size);
+        lock_arena(payload_arena(ptr));
+        bool resized = resize_block(payload_to_header(ptr), asize);
+        unlock_arena();
+        if (resized) {
+            return ptr;
+        }
+    }
+
+    // Otherwise, copy the data to a new block
     newptr = malloc(size);
 
     // If malloc fails, the original block is left untouched
@@ -972,7 +3941,7 @@ void *realloc(void *ptr, size_t size) {
     }
 
     // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
+    copysize = get_usable_size(ptr); // gets size of old payload
     if (size < copysize) {
         copysize = size;
     }
@@ -988,6 +3957,10 @@ void *realloc(void *ptr, size_t size) {
  * @brief Allocates memory for an elements-length array of size bytes each,
  *        initializes the memory to all bytes zero
  *
+ * Only the bytes not known to be zero already are cleared: a block carved
+ * out of fresh memory at the top of an arena, or given its own mapped
+ * region, is mostly zero.
+ *
  * @param[in] elements number of elements to be allocate
  * @param[in] size the size of each element in the array
  * @return a pointer to the allocated memory
@@ -1006,17 +3979,454 @@ void *calloc(size_t elements, size_t size) {
         return NULL;
     }
 
+    zero_lo = NULL;
+    zero_hi = NULL;
     bp = malloc(asize);
     if (bp == NULL) {
         return NULL;
     }
 
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+    // Initialize all bits to 0, skipping the known-zero bytes if they are
+    // part of this block (a thread cache refill may have allocated others)
+    char *end = (char *)bp + asize;
+    bool known = zero_lo >= (char *)bp && zero_lo < zero_hi && zero_lo < end &&
+                 zero_hi <= (char *)bp + get_usable_size(bp);
+    // A fresh mapped region needs no clearing at all
+    dbg_assert(!is_mapped_payload(bp) ||
+               (known && zero_lo == (char *)bp && zero_hi >= end));
+    if (known) {
+        memset(bp, 0, (size_t)(zero_lo - (char *)bp));
+        if (zero_hi < end) {
+            memset(zero_hi, 0, (size_t)(end - zero_hi));
+        }
+    } else {
+        memset(bp, 0, asize);
+    }
+
+    return bp;
+}
+
+/**
+ * @brief Allocates a block whose payload is aligned to align bytes
+ *
+ * Alignments of up to dsize bytes are what malloc gives anyway. Larger ones
+ * are served from the heap of this thread's arena, bypassing the thread
+ * cache and mapped regions.
+ *
+ * @param[in] align The alignment (a power of two)
+ * @param[in] size The requested size to be allocated
+ * @return a pointer to the allocated block of at least size bytes, or NULL
+ */
+static void *malloc_aligned(size_t align, size_t size) {
+    if (align <= dsize) {
+        return malloc(size);
+    }
+
+    // Initialize heap if it isn't initialized
+    if (!ensure_heap()) {
+        dbg_printf("Problem initializing heap. Likely due to sbrk");
+        return NULL;
+    }
+
+    // Ignore spurious and impossibly large requests
+    if (size == 0 || size > SIZE_MAX / 2 || align > SIZE_MAX / 4) {
+        return NULL;
+    }
+    size_t asize = max(round_up(size + wsize, dsize), min_block_size);
+
+    lock_home_arena();
+    drain_remote_frees();
+    dbg_requires(mm_checkheap(__LINE__));
+    block_t *block = malloc_aligned_block(asize, align);
+    dbg_ensures(mm_checkheap(__LINE__));
+    unlock_arena();
+
+    // Blocks too large for an arena heap come from arena 0
+    if (block == NULL && arena != &arenas[0]) {
+        lock_arena(&arenas[0]);
+        drain_remote_frees();
+        block = malloc_aligned_block(asize, align);
+        unlock_arena();
+    }
+    return (block == NULL) ? NULL : header_to_payload(block);
+}
+
+/**
+ * @brief Allocates memory aligned to alignment bytes
+ *
+ * @param[in] alignment the alignment, a power of two
+ * @param[in] size the requested size to be allocated
+ * @return a pointer to the allocated memory, or NULL if the alignment is
+ *         not a power of two
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    return malloc_aligned(alignment, size);
+}
+
+/**
+ * @brief Allocates memory aligned to alignment bytes, POSIX style
+ *
+ * @param[out] memptr where the allocated memory is stored, on success only
+ * @param[in] alignment the alignment, a power of two multiple of
+ *            sizeof(void *)
+ * @param[in] size the requested size to be allocated
+ * @return 0 on success, EINVAL for an invalid alignment, ENOMEM if no memory
+ *         could be allocated
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 ||
+        (alignment & (alignment - 1)) != 0 || alignment == 0) {
+        return EINVAL;
+    }
+    if (size == 0) {
+        *memptr = NULL;
+        return 0;
+    }
+
+    void *bp = malloc_aligned(alignment, size);
+    if (bp == NULL) {
+        return ENOMEM;
+    }
+    *memptr = bp;
+    return 0;
+}
+
+/**
+ * @brief Allocates memory aligned to alignment bytes, rounded up to a power
+ *        of two
+ *
+ * @param[in] alignment the alignment
+ * @param[in] size the requested size to be allocated
+ * @return a pointer to the allocated memory
+ */
+void *memalign(size_t alignment, size_t size) {
+    size_t align = dsize;
+    while (align < alignment) {
+        if (align > SIZE_MAX / 2) {
+            return NULL;
+        }
+        align *= 2;
+    }
+    return malloc_aligned(align, size);
+}
+
+/**
+ * @brief Splits an allocated block into allocated blocks of the same size.
+ *
+ * The last block keeps any remainder too small to be a block of its own.
+ * The blocks are written back to front, so that each header is complete
+ * by the time the block before it updates its prev bits.
+ *
+ * @param[in] block The block to be split
+ * @param[in] asize The adjusted size of each block
+ * @param[out] out Where the payloads of the blocks are stored
+ * @return The number of blocks the block was split into
+ * @pre The block is allocated, and at least asize bytes
+ */
+static size_t carve_block(block_t *block, size_t asize, void **out) {
+    dbg_requires(get_alloc(block));
+    dbg_requires(get_size(block) >= asize);
+
+    size_t n = get_size(block) / asize;
+    size_t last_size = asize + get_size(block) % asize;
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_mini = get_prev_mini(block);
+    block_t *next = find_next(block);
+    for (size_t i = n; i-- > 0;) {
+        block_t *part = (block_t *)((char *)block + i * asize);
+        size_t size = (i == n - 1) ? last_size : asize;
+        if (i == 0) {
+            write_block(part, size, prev_alloc, prev_mini, true);
+        } else {
+            write_block(part, size, true, asize == mini_block_size, true);
+        }
+        out[i] = header_to_payload(part);
+    }
+
+    // Writing the last block set the prev bits in the header of a free next
+    // block, and its footer must repeat them
+    if (!get_alloc(next) && get_size(next) > mini_block_size) {
+        *header_to_footer(next) = next->header;
+    }
+    return n;
+}
+
+/**
+ * @brief Allocates n blocks of the same size
+ *
+ * The blocks are taken from the quick list of their size, then carved out
+ * of a single block found or grown for all of the rest, under one
+ * acquisition of the arena lock. Requests small enough for slab runs or
+ * large enough for a region of their own are allocated one at a time.
+ *
+ * @param[in] size The requested size of each block
+ * @param[in] n The number of blocks to allocate
+ * @param[out] out An array of n pointers where the blocks are stored
+ * @return The number of blocks allocated, which are at the front of out;
+ *         fewer than n if memory ran out
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+    size_t count = 0;
+
+    // Initialize heap if it isn't initialized
+    if (!ensure_heap()) {
+        dbg_printf("Problem initializing heap. Likely due to sbrk");
+        return 0;
+    }
+
+    // Ignore spurious and impossibly large requests
+    if (size == 0 || size > SIZE_MAX / 2) {
+        return 0;
+    }
+
+    if (size <= slab_max ||
+        (map_threshold_min != 0 &&
+         size >= __atomic_load_n(&map_threshold, __ATOMIC_RELAXED))) {
+        while (count < n && (out[count] = malloc(size)) != NULL) {
+            count++;
+        }
+        return count;
+    }
+
+    size_t asize = max(round_up(size + wsize, dsize), min_block_size);
+
+    lock_home_arena();
+    drain_remote_frees();
+    dbg_requires(mm_checkheap(__LINE__));
+
+    block_t *block;
+    while (count < n && (block = quick_pop(asize)) != NULL) {
+        out[count++] = header_to_payload(block);
+    }
+
+    // The rest is carved out of one block, if there is room for it
+    if (count < n && n - count <= SIZE_MAX / 2 / asize) {
+        block = malloc_block((n - count) * asize);
+        if (block != NULL) {
+            count += carve_block(block, asize, out + count);
+        }
+    }
+    while (count < n && (block = malloc_block(asize)) != NULL) {
+        out[count++] = header_to_payload(block);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    unlock_arena();
+
+    // Blocks too large for an arena heap come from arena 0
+    while (count < n && (out[count] = malloc(size)) != NULL) {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Orders payload pointers by address, for qsort
+ */
+static int compare_address(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void *const *)a;
+    uintptr_t y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Frees n allocated blocks
+ *
+ * The pointers are sorted by address, so that runs of neighboring blocks
+ * are merged into one block and coalesced once, under one acquisition of
+ * the arena lock. Blocks of another arena than this thread's are queued
+ * for it, and the thread cache is bypassed.
+ *
+ * @param[in,out] ptrs An array of n pointers to block payloads, or NULL;
+ *                     it is left sorted by address
+ * @param[in] n The number of pointers
+ * @return void
+ * @post the corresponding blocks are freed
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    qsort(ptrs, n, sizeof(*ptrs), compare_address);
+
+    arena_t *locked = NULL;
+    size_t i = 0;
+    while (i < n) {
+        void *bp = ptrs[i++];
+        if (bp == NULL) {
+            continue;
+        }
+
+        if (is_mapped_payload(bp)) {
+            unmap_block(bp);
+            continue;
+        }
+
+        // Blocks of another arena than this thread's are queued for it
+        arena_t *owner = payload_arena(bp);
+        if (MM_THREADS && is_remote(owner)) {
+            remote_free(owner, bp);
+            continue;
+        }
+
+        // A thread without an arena frees each block under its owner's lock
+        if (locked != owner) {
+            if (locked != NULL) {
+                unlock_arena();
+            }
+            lock_arena(owner);
+            dbg_requires(mm_checkheap(__LINE__));
+            locked = owner;
+        }
+
+        if (is_run_payload(bp)) {
+            slab_free(bp);
+            continue;
+        }
+
+        // Absorb the blocks being freed that follow this one
+        block_t *block = payload_to_header(bp);
+        size_t size = get_size(block);
+        while (i < n &&
+               payload_to_header(ptrs[i]) == (block_t *)((char *)block + size)) {
+            size += get_size(payload_to_header(ptrs[i++]));
+        }
+
+        if (size == get_size(block)) {
+            free_locked(bp, size);
+            continue;
+        }
+        write_block(block, size, get_prev_alloc(block), get_prev_mini(block),
+                    true);
+        if (free_block(block) >= quick_flush_size) {
+            quick_flush();
+        }
+    }
+
+    if (locked != NULL) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        unlock_arena();
+    }
+}
+
+/**
+ * @brief Starts a new chunk for a region to bump allocate from.
+ *
+ * @param[in] region The region
+ * @return True on success, false if no memory could be allocated
+ */
+static bool region_grow(mm_arena_t *region) {
+    region_chunk_t *chunk = malloc(region->chunk_size);
+    if (chunk == NULL) {
+        return false;
+    }
+    chunk->next = region->chunks;
+    chunk->size = region->chunk_size;
+    region->chunks = chunk;
+    region->cur = (char *)(chunk + 1);
+    region->end = (char *)chunk + chunk->size;
+    return true;
+}
+
+/**
+ * @brief Creates an empty region
+ *
+ * @param[in] chunk_size The size of the chunks the region takes from the
+ *            heap, or 0 for the default
+ * @return The region, or NULL if no memory could be allocated
+ */
+mm_arena_t *mm_arena_create(size_t chunk_size) {
+    if (chunk_size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    mm_arena_t *region = malloc(sizeof(mm_arena_t));
+    if (region == NULL) {
+        return NULL;
+    }
+
+    region->chunks = NULL;
+    region->chunk_size =
+        (chunk_size == 0)
+            ? region_chunk_size
+            : max(round_up(chunk_size, dsize), 2 * sizeof(region_chunk_t));
+    if (!region_grow(region)) {
+        free(region);
+        return NULL;
+    }
+    return region;
+}
+
+/**
+ * @brief Allocates an object from a region
+ *
+ * Objects of up to a quarter of a chunk are bump allocated from the current
+ * chunk, which is replaced once full; larger ones get a chunk of their own.
+ *
+ * @param[in] region The region
+ * @param[in] size The requested size of the object
+ * @return a pointer to at least size bytes, aligned to dsize, or NULL
+ */
+void *mm_arena_alloc(mm_arena_t *region, size_t size) {
+    // Ignore spurious and impossibly large requests
+    if (size == 0 || size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    size_t asize = round_up(size, dsize);
+
+    if (asize > (size_t)(region->end - region->cur)) {
+        if (asize > region->chunk_size / 4) {
+            region_chunk_t *chunk = malloc(sizeof(region_chunk_t) + asize);
+            if (chunk == NULL) {
+                return NULL;
+            }
+            chunk->next = region->chunks->next;
+            chunk->size = sizeof(region_chunk_t) + asize;
+            region->chunks->next = chunk;
+            return chunk + 1;
+        }
+        if (!region_grow(region)) {
+            return NULL;
+        }
+    }
 
+    void *bp = region->cur;
+    region->cur += asize;
     return bp;
 }
 
+/**
+ * @brief Frees every object of a region, keeping it for reuse
+ *
+ * The current chunk is kept, and the others are returned to the heap, one
+ * free per chunk.
+ *
+ * @param[in] region The region
+ */
+void mm_arena_reset(mm_arena_t *region) {
+    region_chunk_t *chunk = region->chunks->next;
+    while (chunk != NULL) {
+        region_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    region->chunks->next = NULL;
+    region->cur = (char *)(region->chunks + 1);
+}
+
+/**
+ * @brief Frees every object of a region, and the region itself
+ *
+ * @param[in] region The region, or NULL
+ */
+void mm_arena_destroy(mm_arena_t *region) {
+    if (region == NULL) {
+        return;
+    }
+    mm_arena_reset(region);
+    free(region->chunks);
+    free(region);
+}
+
 /*
  *****************************************************************************
  * Do not delete the following super-secret(tm) lines!                       *
@@ -16,6 +16,11 @@ extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void mm_free_sized(void *ptr, size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
 
 #else
 
@@ -59,6 +64,60 @@ extern void *realloc(void *ptr, size_t size);
  * @return A pointer to the first element of the array.
  */
 extern void *calloc(size_t nmemb, size_t size);
+
+/**
+ * @brief  Allocate memory in the heap of at least `size` bytes, aligned to
+ *         `alignment` bytes.
+ *
+ * @param[in] alignment  The alignment, a power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes, or NULL if
+ *          the alignment is not a power of two or no memory is left.
+ */
+extern void *aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * @brief  Allocate memory in the heap of at least `size` bytes, aligned to
+ *         `alignment` bytes, and store its address in `*memptr`.
+ *
+ * @param[out] memptr  Where the address of the allocated bytes is stored.
+ * @param[in] alignment  The alignment, a power of two multiple of
+ *                       sizeof(void *).
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  0 on success, EINVAL if the alignment is invalid, and ENOMEM if
+ *          no memory is left.
+ */
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/**
+ * @brief  Allocate memory in the heap of at least `size` bytes, aligned to
+ *         `alignment` bytes, rounded up to a power of two.
+ *
+ * @param[in] alignment  The alignment.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes.
+ */
+extern void *memalign(size_t alignment, size_t size);
+
+/**
+ * @brief  Marks an allocated block of known size as free.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ * @param[in] size  The size `ptr` was allocated with, or its usable size.
+ */
+extern void free_sized(void *ptr, size_t size);
+
+/**
+ * @brief  Report the number of bytes usable at an allocated block.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ *
+ * @return  At least the size `ptr` was allocated with, or 0 if ptr is NULL.
+ */
+extern size_t malloc_usable_size(void *ptr);
 #endif
 
 /**
@@ -78,4 +137,89 @@ extern bool mm_init(void);
  */
 extern bool mm_checkheap(int line);
 
+/**
+ * @brief  Counters describing the allocator's work since `mm_init`.
+ */
+typedef struct {
+    size_t fit_searches;       /* calls to find_fit */
+    size_t fit_scanned;        /* free blocks examined by find_fit */
+    size_t remote_frees;       /* blocks freed through remote-free queues */
+    size_t trimmed_bytes;      /* bytes given back to memlib by trimming */
+    size_t purged_bytes;       /* bytes of free blocks discarded in memlib */
+    size_t extensions;         /* times the heap was extended */
+    size_t quick_hits;         /* requests served from a quick list */
+    size_t quick_flushes;      /* times the quick lists were coalesced */
+    size_t top_hits;           /* requests carved out of the wilderness */
+    size_t arena_count;        /* arenas in use, at most 16 */
+    size_t lock_acquired[16];  /* per arena: times its lock was taken */
+    size_t lock_contended[16]; /* per arena: times it was already held */
+} mm_stats_t;
+
+/**
+ * @brief  Report counters describing the allocator's work since `mm_init`.
+ *
+ * @param[out] stats  The structure the counters are copied into.
+ */
+extern void mm_get_stats(mm_stats_t *stats);
+
+/**
+ * @brief  Allocate n blocks of the same size at once.
+ *
+ * @param[in]  size  The requested size of each block.
+ * @param[in]  n     The number of blocks to allocate.
+ * @param[out] out   An array of n pointers where the blocks are stored.
+ *
+ * @return  The number of blocks allocated, at the front of out.
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+/**
+ * @brief  Free n blocks at once.
+ *
+ * @param[in,out] ptrs  An array of n pointers, each NULL or to a block;
+ *                      it is left sorted by address.
+ * @param[in]     n     The number of pointers.
+ */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/**
+ * @brief  A region: objects allocated from it have no header, and are only
+ *         freed all at once.
+ */
+typedef struct mm_arena mm_arena_t;
+
+/**
+ * @brief  Create an empty region.
+ *
+ * @param[in] chunk_size  The size of the chunks it takes from the heap, or 0
+ *                        for the default.
+ *
+ * @return  The region, or NULL on failure.
+ */
+extern mm_arena_t *mm_arena_create(size_t chunk_size);
+
+/**
+ * @brief  Allocate an object from a region.
+ *
+ * @param[in] region  The region.
+ * @param[in] size    The requested size.
+ *
+ * @return  A pointer to at least size bytes, or NULL on failure.
+ */
+extern void *mm_arena_alloc(mm_arena_t *region, size_t size);
+
+/**
+ * @brief  Free every object of a region, keeping the region for reuse.
+ *
+ * @param[in] region  The region.
+ */
+extern void mm_arena_reset(mm_arena_t *region);
+
+/**
+ * @brief  Free every object of a region, and the region itself.
+ *
+ * @param[in] region  The region, or NULL.
+ */
+extern void mm_arena_destroy(mm_arena_t *region);
+
 #endif /* mm.h */